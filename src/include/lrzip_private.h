@@ -246,6 +246,7 @@ static inline unsigned char lzma2_prop_from_dic(u32 dicSize)
 /* re-purposed for bzip3
  * This value will be the actual block size from 32MB to 512MB - 1 */
 #define BZIP3_BLOCK_SIZE_FROM_PROP(p) (p == 8 ? 0x1FF00000 : (((u32)2 | ((p) & 1)) << ((p) / 2 + 24)))
+#define BZIP3_MIN_BLOCK (65 * 1024)	/* smallest block size bz3_new accepts */
 static inline unsigned char bzip3_prop_from_block_size(u32 bs)
 {
 	unsigned i;
@@ -282,6 +283,8 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs)
 #define FLAG_OUTPUT		(1 << 25)
 #define FLAG_ZSTD_COMPRESS	(1 << 26)
 #define FLAG_NOBEMT		(1 << 27)
+#define FLAG_GLOBAL_INDEX	(1 << 28)
+#define FLAG_AUTO_COMPRESS	(1 << 29)
 #define NO_HASH		(!(HASH_CHECK) && !(HAS_HASH))
 
 #define CTYPE_NONE 3
@@ -293,6 +296,18 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs)
 #define CTYPE_BZIP3 9
 #define CTYPE_ZSTD 10
 
+/* High bit of the chunk bytes value that starts each chunk, set when
+ * matches may reach back into earlier chunks (--global) */
+#define CHUNK_HISTORY 0x80
+
+/* Since 0.15 the blocks of a chunk are written one after another and listed
+ * at its end in a block directory of stream, c_type, c_len and u_len. The
+ * chunk ends with a trailer of the block count and the offset of the
+ * directory from the chunk header of chunk bytes, eof flag and size. */
+#define BLOCK_ENTRY_LEN 18
+#define CHUNK_TRAILER_LEN 16
+#define CHUNK_HEAD_LEN(cbytes) (2 + (ENCRYPT ? 0 : (cbytes)))
+
 #define PASS_LEN 512
 #define HASH_LEN 64
 #define SALT_LEN 8
@@ -368,6 +383,8 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs)
 #define ENCRYPT		(control->flags & FLAG_ENCRYPT)
 #define SHOW_OUTPUT	(control->flags & FLAG_OUTPUT)
 #define NOBEMT		(control->flags & FLAG_NOBEMT)
+#define GLOBAL_INDEX	(control->flags & FLAG_GLOBAL_INDEX)
+#define AUTO_COMPRESS	(control->flags & FLAG_AUTO_COMPRESS)
 /* Filter flags
  * 0 = none
  * 1 = x86 filter
@@ -405,28 +422,89 @@ static inline unsigned char bzip3_prop_from_block_size(u32 bs)
 #define DELTA_OFFSET_MASK	0b11111000			// delta high 5 bits
 
 
+#define SB_WINDOWS	8	/* Number of high windows of the sliding buffer */
+
+struct sb_window {
+	uchar *buf;	/* The mapping, NULL if unused */
+	i64 offset;	/* Offset of the mapping in the buffer */
+	i64 size;	/* How big the mapping is */
+	i64 last_use;	/* For LRU replacement */
+};
+
 struct sliding_buffer {
 	uchar *buf_low;	/* The low window buffer */
-	uchar *buf_high;/* "" high "" */
+	struct sb_window high[SB_WINDOWS]; /* The high windows */
+	struct sb_window *last_high; /* The window last used */
 	i64 orig_offset;/* Where the original buffer started */
 	i64 offset_low;	/* What the current offset the low buffer has */
-	i64 offset_high;/* "" high buffer "" */
 	i64 offset_search;/* Where the search is up to */
 	i64 orig_size;	/* How big the full buffer would be */
 	i64 size_low;	/* How big the low buffer is */
-	i64 size_high;	/* "" high "" */
-	i64 high_length;/* How big the high buffer should be */
+	i64 high_length;/* How big each high window should be */
+	i64 use_count;	/* Clock for the LRU */
+	i64 high_hits;	/* Accesses found in a high window */
+	i64 high_misses;/* Accesses that needed a window remapped */
+	i64 readaheads;	/* Windows read ahead of a sequential access */
 	int fd;		/* The fd of the mmap */
 };
 
-struct checksum {
-//	uint32_t *cksum;
+/* Slices of a chunk waiting for the checksum worker. Copies are owned and
+ * freed by the worker, slices of the mapped chunk are not. */
+#define CKSUM_RING 8
+
+struct cksum_slice {
 	uchar *buf;
 	i64 len;
+	bool owned;
+};
+
+/* A ring with one writer, the rzip search, and one reader, the checksum
+ * worker. Each side only moves its own index, and the semaphores count
+ * the slices ready and the room left. */
+struct checksum {
+	struct cksum_slice ring[CKSUM_RING];
+	unsigned head;
+	unsigned tail;
+	cksem_t ready;
+	cksem_t room;
+	pthread_t thread;
+};
+
+/* Piped input is read into the chunk's anonymous mapping by a reader
+ * thread while the rzip search trails behind it. The streams of the chunk
+ * are given its size once the reader is done. */
+struct stdin_reader {
+	uchar *buf;
+	i64 size;	/* of the window to fill */
+	i64 filled;
+	bool done;
+	bool eof;
+	void *ss;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+/* The next chunk of a file, mapped and faulted in by a thread while the
+ * current chunk is searched */
+struct chunk_prefetch {
+	uchar *buf;
+	i64 offset;
+	i64 size;
+	int fd;
+	bool active;
+	pthread_t thread;
 };
 
 typedef i64 tag;
 
+/* A tag of the reference file, or of the input in --global mode, and where
+ * it was found */
+struct ref_entry {
+	tag t;
+	i64 pos;
+};
+
 struct node {
 	void *data;
 	struct node *prev;
@@ -434,10 +512,13 @@ struct node {
 
 struct runzip_node {
 	struct stream_info *sinfo;
-	pthread_t *pthreads;
 	struct runzip_node *prev;
 };
 
+/* Histogram buckets for --stats-json, bucket n counts values of 2^n up to
+ * 2^(n+1)-1 */
+#define STATS_BUCKETS 64
+
 struct rzip_state {
 	void *ss;
 	struct node *sslist;
@@ -450,6 +531,9 @@ struct rzip_state {
 	i64 hash_limit;
 	tag minimum_tag_mask;
 	i64 tag_clean_ptr;
+	i64 victim_round;
+	i64 ref_base;		/* hash offsets from here on are in the reference file */
+	i64 hist_size;		/* reference file and earlier chunks before this one */
 	i64 last_match;
 	i64 chunk_size;
 	i64 mmap_size;
@@ -457,7 +541,13 @@ struct rzip_state {
 	uint32_t cksum;
 	int fd_in, fd_out;
 	char stdin_eof;
-	struct {
+	i64 fill_bytes;		/* hash table size, fill and minimum tag mask */
+	double fill;		/* at the end of the last chunk's search */
+	tag fill_mask;
+	struct rzip_stats {
+		i64 chunks;
+		i64 bytes;
+		double search_time;
 		i64 inserts;
 		i64 literals;
 		i64 literal_bytes;
@@ -465,6 +555,13 @@ struct rzip_state {
 		i64 match_bytes;
 		i64 tag_hits;
 		i64 tag_misses;
+		i64 mask_escalations;
+		i64 lazy_windows;
+		i64 lazy_candidates;
+		i64 lazy_gain;
+		i64 zero_runs;
+		i64 len_hist[STATS_BUCKETS];	/* matches by log2 of length */
+		i64 dist_hist[STATS_BUCKETS];	/* and of distance back */
 	} stats;
 };
 
@@ -508,6 +605,8 @@ struct rzip_control {
 	u32 bzip3_block_size;		// actual block size decoded
 	unsigned zstd_level;		// zstd level (1-22)
 	unsigned zstd_strategy;		// zstd strategy (1-9)
+	unsigned zstd_wlog;		// zstd window log. 0 = from level
+	bool zstd_ldm;			// zstd long distance matching
 	char force_bs;			// flag to NOT recompute max bs or min threads
 	i64 window;
 	unsigned long flags;
@@ -515,6 +614,10 @@ struct rzip_control {
 	i64 max_chunk;
 	i64 max_mmap;
 	int threads;
+	int rzip_threads;		// threads used for the rzip match search
+	int chunk_threads;		// chunks searched at once
+	bool rzip_auto;			// rzip level chosen for each chunk
+	unsigned auto_speed;		// --auto throughput target, MB/s. 0 = none
 	int threshold;			// threshold limit. 1-99%. Default no limiter
 	char nice_val;			// added for consistency
 	int current_priority;
@@ -525,6 +628,32 @@ struct rzip_control {
 	int fd_in;
 	int fd_out;
 	int fd_hist;
+	bool sparse;			// pages of zeros are left as holes in fd_out
+
+	/* 0.15+ chunks of the input, found from their trailers at its end */
+	struct chunk_entry *chunk_list;
+	i64 chunk_count;
+
+	/* reference file for matches against data seen by earlier runs */
+	char *ref_name;
+	int ref_fd;
+	i64 ref_size;
+	uchar *ref_buf;
+	struct ref_entry *ref_entries;
+	i64 ref_count;
+
+	/* --stats-json output, opened by main for all files */
+	char *stats_name;
+	FILE *stats_file;
+	bool stats_first;		// no file written to stats_file yet
+
+	/* --global mode: the whole input mapped, its disk backed index, and on
+	 * decompression the file holding the output of earlier chunks */
+	uchar *glob_buf;
+	i64 glob_size;
+	struct ref_entry *glob_entries;
+	i64 glob_count;
+	int glob_fd;
 
 	/* encryption */
 	uchar costfactor;		// cost factor 2s exponent. Will plug into salt[0]
@@ -550,7 +679,6 @@ struct rzip_control {
 	char *crc_label;		// CRC label
 	int *crc_gcode;			// gcrypt CRC code
 	int *crc_len;			// CRC length
-	cksem_t cksumsem;
 	gcry_md_hd_t crc_handle;
 	gcry_md_hd_t hash_handle;
 	uchar *hash_resblock;		// block will have to be allocated at runtime
@@ -561,6 +689,8 @@ struct rzip_control {
 	unsigned char magic_written;
 
 	struct checksum checksum;
+	struct stdin_reader reader;
+	struct chunk_prefetch prefetch;
 
 	const char *util_infile;
 	char delete_infile;
@@ -571,15 +701,21 @@ struct rzip_control {
 	char chunk_bytes;
 	struct sliding_buffer sb;
 	void (*do_mcpy)(rzip_control *, unsigned char *, i64, i64);
-	void (*next_tag)(rzip_control *, struct rzip_state *, i64, tag *);
-	tag (*full_tag)(rzip_control *, struct rzip_state *, i64);
 	i64 (*match_len)(rzip_control *, struct rzip_state *, i64, i64, i64, i64 *);
 
-	pthread_t *pthreads;
-	struct runzip_node *rulist;
 	struct runzip_node *ruhead;
 };
 
+/* A back end compression or decompression job, run by the worker pool */
+struct backend_job {
+	void *(*fn)(void *);	/* called with the job itself */
+	rzip_control *control;
+	struct stream_info *sinfo;
+	int i;			/* thread slot of the job */
+	bool done;
+	struct backend_job *next;
+};
+
 struct uncomp_thread {
 	uchar *s_buf;
 	i64 u_len, c_len;
@@ -587,6 +723,7 @@ struct uncomp_thread {
 	uchar c_type;
 	int busy;
 	int streamno;
+	struct backend_job job;
 };
 
 struct stream {
@@ -599,7 +736,29 @@ struct stream {
 	long unext_thread;
 	long base_thread;
 	int total_threads;
-	i64 last_headofs;
+};
+
+struct block_entry {
+	i64 offset;		/* in the chunk, implied by the order of the blocks */
+	i64 c_len;
+	i64 u_len;
+	uchar c_type;
+	uchar streamno;
+};
+
+struct chunk_entry {
+	i64 start;		/* of the chunk header in the input */
+	i64 dir;		/* of the block directory in the input */
+	i64 blocks;
+};
+
+/* A stream buffer held back in ram while its chunk is searched by a chunk
+ * thread, in the order it was flushed */
+struct stream_block {
+	uchar *buf;
+	i64 len;
+	int streamno;
+	struct stream_block *next;
 };
 
 struct stream_info {
@@ -617,6 +776,16 @@ struct stream_info {
 	long next_thread;
 	int chunks;
 	char chunk_bytes;
+	uchar eof;		/* last chunk, written in the chunk header */
+	bool sized_later;	/* size and eof are not known until posted */
+	cksem_t sized;
+	bool capture;		/* keep flushed buffers until replayed */
+	bool capture_free;	/* written next, not held to the captured limit */
+	struct stream_block *blocks;
+	struct stream_block **last_block;
+	struct block_entry *dir;	/* block directory of the chunk */
+	i64 dir_blocks;
+	i64 dir_size;
 };
 
 extern bool progress_flag ; // print newline when verbose and last print was progress indicator
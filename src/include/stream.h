@@ -13,7 +13,7 @@
 
 bool create_pthread(rzip_control *control, pthread_t *thread, pthread_attr_t * attr,
 	void * (*start_routine)(void *), void *arg);
-bool join_pthread(pthread_t th, void **thread_return);
+bool join_pthread(rzip_control *control, pthread_t th, void **thread_return);
 bool init_mutex(rzip_control *control, pthread_mutex_t *mutex);
 bool unlock_mutex(rzip_control *control, pthread_mutex_t *mutex);
 bool lock_mutex(rzip_control *control, pthread_mutex_t *mutex);
@@ -22,12 +22,21 @@ ssize_t read_1g(rzip_control *control, int fd, void *buf, i64 len);
 i64 get_readseek(rzip_control *control, int fd);
 bool prepare_streamout_threads(rzip_control *control);
 bool close_streamout_threads(rzip_control *control);
+void wait_backend_pool(rzip_control *control);
+void release_buffer_pool(rzip_control *control);
 void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_limit, char cbytes);
+bool find_chunks(rzip_control *control, int fd, i64 first);
 void *open_stream_in(rzip_control *control, int f, int n, char cbytes);
 void flush_buffer(rzip_control *control, struct stream_info *sinfo, int stream);
 void write_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len);
 i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len);
 int close_stream_out(rzip_control *control, void *ss);
+void capture_stream_out(void *ss);
+void limit_captured(i64 limit);
+void release_stream_out(rzip_control *control, void *ss);
+int replay_stream_out(rzip_control *control, void *ss);
+void defer_stream_size(rzip_control *control, void *ss);
+void set_stream_size(rzip_control *control, void *ss, i64 size);
 int close_stream_in(rzip_control *control, void *ss);
 ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret);
 
@@ -524,6 +524,7 @@ static bool get_magic(rzip_control *control, int fd_in, unsigned char *magic)
 		case 12:
 		case 13: /* only filter changes */
 		case 14:
+		case 15: /* block directory per chunk */
 			get_magic_v11(control, fd_in, magic);
 			break;
 		default:
@@ -567,6 +568,7 @@ static bool read_magic(rzip_control *control, int fd_in, i64 *expected_size)
 			case 12:
 			case 13:
 			case 14:
+			case 15:
 				bytes_to_read = MAGIC_LEN;
 				break;
 			default:
@@ -664,9 +666,8 @@ static bool fwrite_stdout(rzip_control *control, void *buf, i64 len)
 	return true;
 }
 
-bool write_fdout(rzip_control *control, void *buf, i64 len)
+static bool write_fdout_data(rzip_control *control, uchar *offset_buf, i64 len)
 {
-	uchar *offset_buf = buf;
 	ssize_t ret, nmemb;
 
 	while (len > 0) {
@@ -685,6 +686,51 @@ bool write_fdout(rzip_control *control, void *buf, i64 len)
 	return true;
 }
 
+static inline bool zero_page(const uchar *buf, i64 len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/* Write to a sparse output file. Pages of the file that would be all zeros
+ * are seeked over and left as holes, and the file is extended over a hole
+ * at the end since it may be read back for matches before more is written. */
+static bool write_fdout_sparse(rzip_control *control, uchar *buf, i64 len)
+{
+	i64 pos = lseek(control->fd_out, 0, SEEK_CUR), n, run;
+	bool zero = false;
+
+	if (unlikely(pos == -1))
+		fatal("Failed to seek fd_out in write_fdout_sparse\n");
+	while (len > 0) {
+		/* Pages of the same kind, the first up to a page boundary */
+		n = MIN(len, control->page_size - pos % control->page_size);
+		zero = zero_page(buf, n);
+		for (run = n; run < len; run += n) {
+			n = MIN(len - run, control->page_size);
+			if (zero_page(buf + run, n) != zero)
+				break;
+		}
+		if (zero) {
+			if (unlikely(lseek(control->fd_out, run, SEEK_CUR) == -1))
+				fatal("Failed to seek over %'"PRId64" zeros in write_fdout_sparse\n", run);
+		} else
+			write_fdout_data(control, buf, run);
+		pos += run;
+		buf += run;
+		len -= run;
+	}
+	if (zero && unlikely(ftruncate(control->fd_out, pos)))
+		fatal("Failed to extend fd_out over a hole in write_fdout_sparse\n");
+	return true;
+}
+
+bool write_fdout(rzip_control *control, void *buf, i64 len)
+{
+	if (control->sparse && len > 0)
+		return write_fdout_sparse(control, buf, len);
+	return write_fdout_data(control, buf, len);
+}
+
 bool flush_tmpoutbuf(rzip_control *control)
 {
 	if (!TEST_ONLY) {
@@ -811,6 +857,7 @@ static bool read_tmpinmagic(rzip_control *control, int fd_in)
 			case 12:
 			case 13:
 			case 14:
+			case 15:
 				bytes_to_read = MAGIC_LEN;
 				break;
 			default:
@@ -1063,6 +1110,122 @@ static double percentage(i64 num, i64 den)
 	return d_num / d_den;
 }
 
+static const char *ctype_name(rzip_control *control, uchar ctype)
+{
+	switch (ctype) {
+		case CTYPE_NONE:	return "none";
+		case CTYPE_BZIP2:	return "bzip2";
+		case CTYPE_LZO:		return "lzo";
+		case CTYPE_LZMA:	return "lzma";
+		case CTYPE_GZIP:	return "gzip";
+		case CTYPE_ZPAQ:	return "zpaq";
+		case CTYPE_BZIP3:	return "bzip3";
+		case CTYPE_ZSTD:	return "zstd";
+	}
+	fatal("Unknown Compression Type: %'d\n", ctype);
+	return NULL;
+}
+
+/* Blocks of --auto archives use several back ends. Blocks left uncompressed
+ * say nothing about the method, so only count the others */
+#define CTYPE_MIXED 254
+
+static void note_ctype(uchar *save_ctype, uchar ctype)
+{
+	if (*save_ctype == 255 || *save_ctype == CTYPE_NONE)
+		*save_ctype = ctype;
+	else if (ctype != CTYPE_NONE && ctype != *save_ctype)
+		*save_ctype = CTYPE_MIXED;
+}
+
+/* Show the blocks of a 0.15+ chunk from its block directory. ofs is just past
+ * the chunk header, the directory is found from the trailer ending the chunk.
+ * Returns the offset of the next chunk. */
+static i64 get_directory_info(rzip_control *control, int fd_in, i64 ofs, char chunk_byte,
+			      i64 *utotal, i64 *ctotal, uchar *save_ctype)
+{
+	i64 start = ofs - CHUNK_HEAD_LEN(chunk_byte), dir_ofs, blocks, len, block_ofs, i;
+	struct chunk_entry *chunk = NULL;
+	uchar salt[SALT_LEN], *dir, *p;
+	int stream;
+
+	if (!control->chunk_list && unlikely(!find_chunks(control, fd_in, start)))
+		fatal("Failed to find the chunks, likely corrupted/truncated archive.\n");
+	for (i = 0; i < control->chunk_count; i++) {
+		if (control->chunk_list[i].start == start) {
+			chunk = &control->chunk_list[i];
+			break;
+		}
+	}
+	if (unlikely(!chunk))
+		fatal("No chunk trailer for the chunk at %'"PRId64", likely corrupted archive.\n", start);
+	dir_ofs = chunk->dir - ofs;
+	blocks = chunk->blocks;
+	if (unlikely(lseek(fd_in, chunk->dir, SEEK_SET) == -1))
+		fatal("Failed to seek to block directory in get_fileinfo\n");
+	len = blocks * BLOCK_ENTRY_LEN;
+	if (ENCRYPT) {
+		if (unlikely(read(fd_in, salt, SALT_LEN) != SALT_LEN))
+			fatal("Failed to read block directory salt in get_fileinfo\n");
+		len = MAX(len, *control->enc_keylen);
+	}
+	dir = malloc(MAX(len, 1));
+	if (unlikely(!dir))
+		fatal("Failed to malloc block directory in get_fileinfo\n");
+	if (unlikely(read(fd_in, dir, len) != len))
+		fatal("Failed to read block directory in get_fileinfo\n");
+	if (ENCRYPT && unlikely(!lrz_decrypt(control, dir, len, salt, LRZ_VALIDATE)))
+		fatal("Failed to decrypt block directory in get_fileinfo\n");
+
+	for (stream = 0; stream < NUM_STREAMS; stream++) {
+		int block = 1;
+
+		if (INFO) {
+			print_verbose("Stream: %'d\n", stream);
+			print_verbose("%s\t%s\t%s\t%16s / %14s", "Block","Comp","Percent","Comp Size", "UComp Size");
+			print_maxverbose("%18s", "Offset");
+			print_verbose("\n");
+		}
+		block_ofs = ofs;
+		for (i = 0, p = dir; i < blocks; i++, p += BLOCK_ENTRY_LEN) {
+			i64 c_len, u_len;
+
+			memcpy(&c_len, p + 2, 8);
+			memcpy(&u_len, p + 10, 8);
+			c_len = le64toh(c_len);
+			u_len = le64toh(u_len);
+			if (unlikely(p[0] >= NUM_STREAMS || c_len < 1 || u_len < 1 || c_len > dir_ofs))
+				fatal("Invalid block directory entry, likely corrupted archive%s.\n",
+				      ENCRYPT ? " or bad password" : "");
+			if (ENCRYPT)
+				block_ofs += SALT_LEN;
+			if (p[0] == stream) {
+				const char *name = ctype_name(control, p[1]);
+
+				note_ctype(save_ctype, p[1]);
+				*utotal += u_len;
+				*ctotal += c_len;
+				if (INFO) {
+					print_verbose("%'d\t%s\t%5.1f%%\t%'16"PRId64" / %'14"PRId64"",
+						      block, name, percentage(c_len, u_len), c_len, u_len);
+					print_maxverbose("%'18"PRId64"", block_ofs);
+					print_verbose("\n");
+				}
+				block++;
+			}
+			block_ofs += MAX(c_len, *control->enc_keylen);
+		}
+	}
+	dealloc(dir);
+	if (unlikely(block_ofs != chunk->dir))
+		fatal("Blocks do not end at the block directory, likely corrupted archive.\n");
+	/* The next chunk header is read from past the trailer */
+	ofs = chunk->dir + (ENCRYPT ? SALT_LEN : 0) + len + CHUNK_TRAILER_LEN;
+	if (unlikely(lseek(fd_in, ofs, SEEK_SET) == -1))
+		fatal("Failed to seek past chunk trailer in get_fileinfo\n");
+	return ofs;
+}
+
 // If Decompressing or Testing, omit printing, just read file and see if valid
 // using construct if (INFO)
 // Encrypted files cannot be checked now
@@ -1122,6 +1285,10 @@ bool get_fileinfo(rzip_control *control)
 	if (control->major_version == 0) {
 		if (unlikely(read(fd_in, &chunk_byte, 1) != 1))
 			fatal("Failed to read chunk_byte in get_fileinfo\n");
+		if (chunk_byte & CHUNK_HISTORY) {
+			print_verbose("Matches reach into earlier chunks (--global)\n");
+			chunk_byte &= ~CHUNK_HISTORY;
+		}
 		if (unlikely(chunk_byte < 1 || chunk_byte > 8))
 			fatal("Invalid chunk bytes %'d\n", chunk_byte);
 		if (unlikely(read(fd_in, &control->eof, 1) != 1))
@@ -1147,6 +1314,7 @@ bool get_fileinfo(rzip_control *control)
 				case 12:
 				case 13:
 				case 14:
+				case 15:
 					ofs = MAGIC_LEN + 2 + control->comment_length;
 					break;
 			}
@@ -1170,6 +1338,7 @@ bool get_fileinfo(rzip_control *control)
 					case 12:
 					case 13:
 					case 14:
+					case 15:
 						ofs = MAGIC_LEN + 2 + control->comment_length;
 						break;
 					default: fatal("Cannot decrypt earlier versions of lrzip-next\n");
@@ -1196,6 +1365,10 @@ next_chunk:
 		else
 			print_verbose("N/A %s Encrypted File\n", control->enc_label);
 	}
+	if (control->minor_version >= 15) {
+		ofs = get_directory_info(control, fd_in, ofs, chunk_byte, &utotal, &ctotal, &save_ctype);
+		goto chunk_end;
+	}
 	while (stream < NUM_STREAMS) {
 		int block = 1;
 
@@ -1217,6 +1390,7 @@ next_chunk:
 			print_verbose("\n");
 		}
 		do {
+			const char *name;
 			i64 head_off;
 
 			if (unlikely(last_head && last_head <= second_last))
@@ -1237,30 +1411,12 @@ next_chunk:
 				return false;
 			if (unlikely(last_head < 0 || c_len < 0 || u_len < 0))
 				fatal("Entry negative, likely corrupted archive.\n");
-			if (INFO) print_verbose("%'d\t", block);
-			if (ctype == CTYPE_NONE) {
-				if (INFO) print_verbose("none");
-			} else if (ctype == CTYPE_BZIP2) {
-				if (INFO) print_verbose("bzip2");
-			} else if (ctype == CTYPE_LZO) {
-				if (INFO) print_verbose("lzo");
-			} else if (ctype == CTYPE_LZMA) {
-				if (INFO) print_verbose("lzma");
-			} else if (ctype == CTYPE_GZIP) {
-				if (INFO) print_verbose("gzip");
-			} else if (ctype == CTYPE_ZPAQ) {
-				if (INFO) print_verbose("zpaq");
-			} else if (ctype == CTYPE_BZIP3) {
-				if (INFO) print_verbose("bzip3");
-			} else if (ctype == CTYPE_ZSTD) {
-				if (INFO) print_verbose("zstd");
-			} else
-				fatal("Unknown Compression Type: %'d\n", ctype);
-			if (save_ctype == 255)
-				save_ctype = ctype; /* need this for lzma when some chunks could have no compression
-						     * and info will show rzip + none on info display if last chunk
-						     * is not compressed. Adjust for all types in case it's used in
-						     * the future */
+			name = ctype_name(control, ctype);
+			if (INFO) print_verbose("%'d\t%s", block, name);
+			note_ctype(&save_ctype, ctype); /* need this for lzma when some chunks could have no compression
+							 * and info will show rzip + none on info display if last chunk
+							 * is not compressed. Adjust for all types in case it's used in
+							 * the future */
 			utotal += u_len;
 			ctotal += c_len;
 			if (INFO) {
@@ -1273,9 +1429,13 @@ next_chunk:
 		++stream;
 	}
 
+	/* Encrypted blocks are padded to at least the key length, which the
+	 * empty block ending a stream on a full buffer is */
+	if (ENCRYPT)
+		c_len = MAX(c_len, *control->enc_keylen);
 	if (unlikely((ofs = lseek(fd_in, c_len, SEEK_CUR)) == -1))
 		fatal("Failed to lseek c_len in get_fileinfo\n");
-
+chunk_end:
 	if (ofs >= infile_size - *control->hash_len)
 		goto done;
 	else if (ENCRYPT)
@@ -1288,6 +1448,7 @@ next_chunk:
 		if(!ENCRYPT) {
 			if (unlikely(read(fd_in, &chunk_byte, 1) != 1))
 				fatal("Failed to read chunk_byte in get_fileinfo\n");
+			chunk_byte &= ~CHUNK_HISTORY;
 			if (unlikely(chunk_byte < 1 || chunk_byte > 8))
 				fatal("Invalid chunk bytes %'d\n", chunk_byte);
 			ofs++;
@@ -1304,7 +1465,10 @@ next_chunk:
 		else {
 			// ENCRYPTED
 			// no change to chunk_byte
-			ofs+=10;
+			if (control->minor_version >= 15)
+				ofs += 2;
+			else
+				ofs+=10;
 			// no change to header_length
 		}
 	}
@@ -1352,11 +1516,21 @@ done:
 				print_output("\n");
 		}
 		else if (save_ctype == CTYPE_BZIP3) {
-			print_output("rzip + bzip3 -- Block Size: %d - %'"PRIu32"\n", control->bzip3_bs, control->bzip3_block_size);
+			print_output("rzip + bzip3 ");
+			if (control->bzip3_block_size)	// not stored when chosen by --auto
+				print_output("-- Block Size: %d - %'"PRIu32"\n", control->bzip3_bs, control->bzip3_block_size);
+			else
+				print_output("\n");
 		}
 		else if (save_ctype == CTYPE_ZSTD) {
-			print_output("rzip + zstd -- zstd level: %d, zstd strategy: %d\n", control->zstd_level, control->zstd_strategy);
+			print_output("rzip + zstd ");
+			if (control->zstd_level)	// not stored when chosen by --auto
+				print_output("-- zstd level: %d, zstd strategy: %d\n", control->zstd_level, control->zstd_strategy);
+			else
+				print_output("\n");
 		}
+		else if (save_ctype == CTYPE_MIXED)
+			print_output("rzip + back end chosen for each block (auto)\n");
 		else
 			print_output("Dunno wtf\n");
 
@@ -1450,6 +1624,8 @@ done:
 	}
 
 out:
+	dealloc(control->chunk_list);
+	control->chunk_count = 0;
 	if (unlikely(close(fd_in)))
 		fatal("Failed to close fd_in in get_fileinfo\n");
 	return true;
@@ -1653,7 +1829,12 @@ bool decompress_file(rzip_control *control)
 		if (ENCRYPT)
 			fatal("Cannot decompress encrypted file from STDIN\n");
 		expected_size = control->st_size;
-		if (unlikely(!open_tmpinbuf(control)))
+		/* Since 0.15 the chunks are found from the end of the input,
+		 * so all of it is spooled to the temporary file first */
+		if (control->minor_version >= 15) {
+			if (unlikely(!read_tmpinfile(control, fd_in)))
+				return false;
+		} else if (unlikely(!open_tmpinbuf(control)))
 			return false;
 	} else {
 		fd_in = open(infilecopy, O_RDONLY);
@@ -1827,6 +2008,10 @@ bool initialise_control(rzip_control *control)
 	control->threshold = 100;		/* default for no threshold limiting */
 	/* for testing single CPU */
 	control->threads = PROCESSORS;		/* get CPUs for LZMA */
+	control->rzip_threads = 1;		/* single threaded match search */
+	control->chunk_threads = 1;		/* one chunk at a time */
+	control->ref_fd = -1;			/* no reference file */
+	control->glob_fd = -1;			/* no history of earlier chunks */
 	control->page_size = PAGE_SIZE;
 	control->nice_val = 19;
 
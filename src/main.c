@@ -124,6 +124,8 @@ static void usage(void)
 	print_output("	-n, --no-compress	no backend compression - prepare for other compressor\n");
 	print_output("	-z, --zpaq		zpaq compression (best, extreme compression, extremely slow)\n");
 	print_output("	-Z, --zstd		zstd compression\n");
+	print_output("	--auto [=MB/s]		choose lzma, bzip3, zstd, lzo or none for each block,\n\t\t\t\t\
+optionally keeping to a throughput target in MB/s\n");
 	print_output("	-L#, --level #		set lzma/bzip2/gzip compression level (1-9, default 7)\n");
 	print_output("	--fast			alias for -L1\n");
 	print_output("	--best			alias for -L9\n");
@@ -132,6 +134,8 @@ static void usage(void)
 	print_output("	--zpaqbs		Set ZPAQ Block Size overriding defaults. 1-11, 2^zpaqbs * 1MB\n");
 	print_output("	--bzip3bs		Set bzip3 Block Size. 0-8, 32MB to 511MB.\n");
 	print_output("	--zstd-level		Set zstd level (1-22)\n");
+	print_output("	--zstd-window		Set zstd window log (10-31, default from level)\n");
+	print_output("	--zstd-long		zstd long distance matching, window log 27 unless set\n");
 	print_output("    Filtering Options:\n");
 	print_output("	--x86			Use x86 filter (for all compression modes)\n");
 	print_output("	--arm			Use ARM filter (for all compression modes)\n");
@@ -157,7 +161,14 @@ static void usage(void)
 	print_output("	-m, --maxram size	Set maximum available ram in hundreds of MB\n\t\t\t\tOverrides detected amount of available ram. \
 Useful for testing\n");
 	print_output("	-N, --nice-level value	Set nice value to value (default 19)\n");
-	print_output("	-R, --rzip-level level	Set independent RZIP Compression Level (1-9) for pre-processing (default=compression level)\n");
+	print_output("	-R, --rzip-level level	Set independent RZIP Compression Level (1-10, or auto) for pre-processing (default=compression level)\n");
+	print_output("	--rzip-threads value	Set number of threads for the RZIP match search (default 1)\n");
+	print_output("	--chunk-threads value	Search this many chunks at once, each with a share of the window (default 1)\n");
+	print_output("	--reference file	Match against a reference file, e.g. an earlier version of the input.\n\t\t\t\t\
+Its index is kept in file.lrzidx. The same file is needed to decompress\n");
+	print_output("	--global		Index the whole file first so matches can reach back into earlier chunks\n\t\t\t\t\
+Useful when the file is much larger than the compression window\n");
+	print_output("	--stats-json file	Write rzip statistics for each chunk to file in JSON format\n");
 	print_output("	-T, --threshold [limit]	Disable LZ4 compressibility testing OR set limit to determine compressibiity (1-99)\n\t\t\t\t\
 Note: Since limit is optional, the short option must not have a space. e.g. -T75, not -T 75\n");
 	print_output("	-U, --unlimited		Use unlimited window size beyond ramsize (potentially much slower)\n");
@@ -168,6 +179,7 @@ default chosen by heuristic dependent on ram and chosen compression\n");
 	print_output("	-e, -f -o -O		Same as Compression Options\n");
 	print_output("	-t, --test		test compressed file integrity\n");
 	print_output("	-c, --check		check integrity of file written on decompression\n");
+	print_output("	--reference file	Reference file used on compression\n");
 	print_output("General Options:\n----------------\n");
 	print_output("	-h, -?, --help		show help\n");
 	print_output("	-H, --hash [hash code]	Set hash to compute (default md5) 1-13 (see manpage)\n");
@@ -235,6 +247,7 @@ static void show_summary(void)
 		/* show compression options */
 		if (!DECOMPRESS && !TEST_ONLY) {
 			print_verbose("Compression mode is: %s",
+					(AUTO_COMPRESS ? "AUTO" :
 					(LZMA_COMPRESS ? "LZMA" :
 					(LZO_COMPRESS ? "LZO\n" :	// No Threshold testing
 					(BZIP2_COMPRESS ? "BZIP2" :
@@ -242,13 +255,28 @@ static void show_summary(void)
 					(ZPAQ_COMPRESS ? "ZPAQ" :
 					(BZIP3_COMPRESS ? "BZIP3" :
 					(ZSTD_COMPRESS ? "ZSTD" :
-					(NO_COMPRESS ? "RZIP pre-processing only" : "wtf")))))))));
+					(NO_COMPRESS ? "RZIP pre-processing only" : "wtf"))))))))));
 			if (!LZO_COMPRESS && !ZLIB_COMPRESS)
 				print_verbose(". LZ4 Compressibility testing %s\n", (LZ4_TEST? "enabled" : "disabled"));
 			if (LZ4_TEST && control->threshold != 100)
 				print_verbose("Threshhold limit = %'d\%\n", control->threshold);
 			print_verbose("Compression level %'d\n", control->compression_level);
-			print_verbose("RZIP Compression level %'d\n", control->rzip_compression_level);
+			if (AUTO_COMPRESS && control->auto_speed)
+				print_verbose("Back end throughput target: %'u MB/s\n", control->auto_speed);
+			if (control->rzip_auto)
+				print_verbose("RZIP Compression level auto, chosen for each chunk\n");
+			else
+				print_verbose("RZIP Compression level %'d\n", control->rzip_compression_level);
+			if (control->rzip_threads > 1)
+				print_verbose("RZIP match search threads: %'d\n", control->rzip_threads);
+			if (control->chunk_threads > 1)
+				print_verbose("RZIP chunk threads: %'d\n", control->chunk_threads);
+			if (control->ref_name)
+				print_verbose("Reference file: %s\n", control->ref_name);
+			if (GLOBAL_INDEX)
+				print_verbose("Global index of the whole file\n");
+			if (control->stats_name)
+				print_verbose("RZIP statistics written to: %s\n", control->stats_name);
 			if (LZMA_COMPRESS)
 				print_verbose("Initial LZMA Dictionary Size: %'"PRIu32"\n", control->dictSize );
 			if (ZPAQ_COMPRESS)
@@ -258,8 +286,13 @@ static void show_summary(void)
 				print_verbose("BZIP3 Compression Block Size: %'"PRIu32"\n",
 					       control->bzip3_block_size);
 			if (ZSTD_COMPRESS)
+			{
 				print_verbose("ZSTD Compression Level: %d, ZSTD Compression Strategy: %s\n",
 						control->zstd_level, zstd_strategies[control->zstd_strategy]);
+				if (control->zstd_wlog || control->zstd_ldm)
+					print_verbose("ZSTD Window Log: %d, Long Distance Matching: %s\n",
+							control->zstd_wlog, control->zstd_ldm ? "on" : "off");
+			}
 			if (NOBEMT)
 				print_verbose("No Backend Multi Threading\n");
 			if (FILTER_USED) {
@@ -354,7 +387,15 @@ static struct option long_options[] = {
 	{"riscv",	no_argument,	0,	0},		/* 50 */
 	{"delta",	optional_argument,	0,	0},	/* 51 FILTEREND */
 	{"costfactor",	required_argument,	0,	0},
-	{0,	0,	0,	0},				/* 53 */
+	{"rzip-threads",	required_argument,	0,	0},	/* 53 */
+	{"reference",	required_argument,	0,	0},	/* 54 */
+	{"global",	no_argument,	0,	0},		/* 55 */
+	{"stats-json",	required_argument,	0,	0},	/* 56 */
+	{"chunk-threads",	required_argument,	0,	0},	/* 57 */
+	{"auto",	optional_argument,	0,	0},	/* 58 */
+	{"zstd-window",	required_argument,	0,	0},	/* 59 */
+	{"zstd-long",	no_argument,	0,	0},		/* 60 */
+	{0,	0,	0,	0},
 };
 
 /* constants for ease of maintenance in getopt loop */
@@ -381,6 +422,7 @@ int main(int argc, char *argv[])
 	double seconds,total_time; // for timers
 	bool nice_set = false;
 	int c, i, ds, long_opt_index;
+	ZSTD_bounds wlog;
 	int hours,minutes;
 	extern int optind;
 	char *eptr, *av; /* for environment */
@@ -432,10 +474,10 @@ int main(int argc, char *argv[])
 			/* If some compression was chosen in lrzip.conf, allow this one time
 			 * because conf_file_compression_set will be true
 			 */
-			if ((control->flags & FLAG_NOT_LZMA) && conf_file_compression_set == false)
-				fatal("Can only use one of -l, -b, -B, -g, -z, -Z or -n\n");
+			if ((control->flags & (FLAG_NOT_LZMA | FLAG_AUTO_COMPRESS)) && conf_file_compression_set == false)
+				fatal("Can only use one of -l, -b, -B, -g, -z, -Z, -n or --auto\n");
 			/* Select Compression Mode */
-			control->flags &= ~FLAG_NOT_LZMA; 		/* must clear all compressions first */
+			control->flags &= ~(FLAG_NOT_LZMA | FLAG_AUTO_COMPRESS);	/* must clear all compressions first */
 			if (c == 'b')
 				control->flags |= FLAG_BZIP2_COMPRESS;
 			else if (c == 'B')
@@ -523,12 +565,18 @@ int main(int argc, char *argv[])
 				fatal("Invalid compression level (must be 1-9)\n");
 			break;
 		case 'R':
-			/* explicitly set rzip compression level */
+			/* explicitly set rzip compression level, or choose it for
+			 * each chunk */
+			if (!strcasecmp(optarg, "auto")) {
+				control->rzip_auto = true;
+				break;
+			}
+			control->rzip_auto = false;
 			control->rzip_compression_level = strtol(optarg, &endptr, 10);
 			if (*endptr)
 				fatal("Extra characters after rzip compression level: \'%s\'\n", endptr);
-			if (control->rzip_compression_level < 1 || control->rzip_compression_level > 9)
-				fatal("Invalid rzip compression level (must be 1-9)\n");
+			if (control->rzip_compression_level < 1 || control->rzip_compression_level > 10)
+				fatal("Invalid rzip compression level (must be 1-10)\n");
 			break;
 		case 'm':
 			control->ramsize = strtol(optarg, &endptr, 10) * ONE_MB * 100;
@@ -641,7 +689,7 @@ int main(int argc, char *argv[])
 				switch(long_opt_index) {
 					/* in case lzma selected, need to reset not lzma flag */
 					case LONGSTART:
-						control->flags &= ~FLAG_NOT_LZMA;		/* clear alternate compression flags */
+						control->flags &= ~(FLAG_NOT_LZMA | FLAG_AUTO_COMPRESS);	/* clear alternate compression flags */
 						break;
 					case LONGSTART+1:
 						/* Dictionary Size,	2<<11, 3<<11
@@ -762,6 +810,72 @@ int main(int argc, char *argv[])
 							control->costfactor = control->salt[0] = i;
 						}
 						break;
+					case FILTEREND+2:
+						i = strtol(optarg, &endptr, 10);
+						if (*endptr)
+							fatal("Extra characters after number of rzip threads: \'%s\'\n", endptr);
+						if (i < 1)
+							fatal("Must have at least one rzip thread\n");
+						control->rzip_threads = i;
+						break;
+					case FILTEREND+3:
+						control->ref_name = strdup(optarg);
+						if (unlikely(!control->ref_name))
+							fatal("Failed to allocate reference file name\n");
+						break;
+					case FILTEREND+4:
+						control->flags |= FLAG_GLOBAL_INDEX;
+						break;
+					case FILTEREND+5:
+						control->stats_name = strdup(optarg);
+						if (unlikely(!control->stats_name))
+							fatal("Failed to allocate statistics file name\n");
+						break;
+					case FILTEREND+6:
+						i = strtol(optarg, &endptr, 10);
+						if (*endptr)
+							fatal("Extra characters after number of chunk threads: \'%s\'\n", endptr);
+						if (i < 1)
+							fatal("Must have at least one chunk thread\n");
+						control->chunk_threads = i;
+						break;
+					case FILTEREND+7:
+						if ((control->flags & FLAG_NOT_LZMA) && conf_file_compression_set == false)
+							fatal("Can only use one of -l, -b, -B, -g, -z, -Z, -n or --auto\n");
+						/* lzma stays the archive method. Blocks given to the
+						 * other back ends are told apart by their own type */
+						control->flags &= ~FLAG_NOT_LZMA;
+						control->flags |= FLAG_AUTO_COMPRESS;
+						conf_file_compression_set = false;
+						if (optarg) {
+							i = strtol(optarg, &endptr, 10);
+							if (*endptr)
+								fatal("Extra characters after throughput target: \'%s\'\n", endptr);
+							if (i < 1)
+								fatal("Throughput target must be at least 1 MB/s\n");
+							control->auto_speed = i;
+						}
+						break;
+					case FILTEREND+8:
+						if (!ZSTD_COMPRESS)
+							print_err("--zstd-window option only valid for ZSTD compression. Ignored.\n");
+						else {
+							ds = strtol(optarg, &endptr, 10);
+							if (*endptr)
+								fatal("Extra characters after zstd window log: \'%s\'\n", endptr);
+							wlog = ZSTD_cParam_getBounds(ZSTD_c_windowLog);	// 30 on 32 bit systems
+							if (ds < wlog.lowerBound || ds > wlog.upperBound)
+								fatal("ZSTD window log must be between %d and %d.\n",
+								      wlog.lowerBound, wlog.upperBound);
+							control->zstd_wlog = ds;
+						}
+						break;
+					case FILTEREND+9:
+						if (!ZSTD_COMPRESS)
+							print_err("--zstd-long option only valid for ZSTD compression. Ignored.\n");
+						else
+							control->zstd_ldm = true;
+						break;
 				}	//switch
 			}	//if filter used
 			break;	// break out of longopt switch
@@ -825,6 +939,13 @@ int main(int argc, char *argv[])
 			control->zstd_level = zstd_compression_level[control->compression_level];
 			control->zstd_strategy = control->compression_level;
 		}
+		/* as zstd --long does, long distance matching reaches 128MB back */
+		if (control->zstd_ldm && !control->zstd_wlog)
+			control->zstd_wlog = 27;
+	} else if (AUTO_COMPRESS) {
+		/* --auto only turns to zstd for speed, so keep it at a fast level */
+		control->zstd_level = zstd_compression_level[2];
+		control->zstd_strategy = 2;
 	}
 
 	if (VERBOSE && !SHOW_PROGRESS) {
@@ -860,6 +981,19 @@ int main(int argc, char *argv[])
 		control->flags &= ~FLAG_THRESHOLD;
 	}
 
+	if (control->stats_name) {
+		if (DECOMPRESS || INFO || TEST_ONLY) {
+			print_err("RZIP statistics are only written on compression.\n");
+			dealloc(control->stats_name);
+		} else {
+			control->stats_file = fopen(control->stats_name, "w");
+			if (unlikely(!control->stats_file))
+				fatal("Failed to open statistics file %s\n", control->stats_name);
+			fputs("[\n", control->stats_file);
+			control->stats_first = true;
+		}
+	}
+
 	setup_overhead(control);
 
 	/* Set the main nice value to half that of the backend threads since
@@ -976,9 +1110,12 @@ int main(int argc, char *argv[])
 		} else if (INFO) {
 			if (unlikely(!get_fileinfo(&local_control)))
 				return -1;
-		} else
+		} else {
 			if (unlikely(!compress_file(&local_control)))
 				return -1;
+			/* The next file's statistics follow this one's */
+			control->stats_first = local_control.stats_first;
+		}
 
 		/* compute total time */
 		gettimeofday(&end_time, NULL);
@@ -991,5 +1128,11 @@ int main(int argc, char *argv[])
 			print_output("Total time: %02d:%02d:%05.2f\n", hours, minutes, seconds);
 	}
 
+	if (control->stats_file) {
+		fputs("\n]\n", control->stats_file);
+		if (unlikely(fclose(control->stats_file)))
+			fatal("Failed to write statistics file %s\n", control->stats_name);
+	}
+
 	return 0;
 }
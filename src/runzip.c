@@ -181,7 +181,55 @@ static i64 read_fdhist(rzip_control *control, void *buf, i64 len)
 	return len;
 }
 
-static i64 unzip_match(rzip_control *control, void *ss, i64 len, int chunk_bytes)
+/* A match reaching back before the start of the chunk, back bytes from it,
+ * is in the output of the earlier chunks when they are kept (--global), and
+ * in the reference file before them otherwise. Both are read from files, so
+ * only the match itself is held in ram. */
+static i64 unzip_hist_match(rzip_control *control, i64 len, i64 back, i64 tally)
+{
+	uchar *buf;
+	i64 pos;
+	int fd;
+
+	if (back <= tally) {
+		if (unlikely(!GLOBAL_INDEX || len > back))
+			fatal("Match outside of earlier chunks in corrupt archive\n");
+		fd = control->glob_fd;
+		pos = tally - back;
+	} else {
+		back -= tally;
+		if (unlikely(control->ref_fd == -1))
+			fatal("This archive has matches in a reference file. Use --reference to give it\n");
+		if (unlikely(back > control->ref_size || len > back))
+			fatal("Match outside of reference file %s. Wrong reference file or corrupt archive\n",
+			      control->ref_name);
+		fd = control->ref_fd;
+		pos = control->ref_size - back;
+	}
+
+	buf = (uchar *)malloc(len);
+	if (unlikely(!buf))
+		fatal("Failed to malloc match buffer of size %'"PRId64"\n", len);
+	if (unlikely(pread(fd, buf, len, pos) != len)) {
+		dealloc(buf);
+		fatal("Failed to read %'"PRId64" bytes of history at %'"PRId64"\n", len, pos);
+	}
+	if (unlikely(write_1g(control, buf, (size_t)len) != (ssize_t)len)) {
+		dealloc(buf);
+		fatal("Failed to write %'"PRId64" bytes in unzip_hist_match\n", len);
+	}
+
+	if (!HAS_HASH)
+		gcry_md_write(control->crc_handle, buf, len);
+	if (HAS_HASH)
+		gcry_md_write(control->hash_handle, buf, len);
+
+	dealloc(buf);
+	return len;
+}
+
+static i64 unzip_match(rzip_control *control, void *ss, i64 len, int chunk_bytes, i64 chunk_pos,
+			i64 tally)
 {
 	i64 offset, n, total, cur_pos;
 	uchar *buf;
@@ -198,6 +246,8 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, int chunk_bytes
 	offset = read_vchars(control, ss, 0, chunk_bytes);
 	if (unlikely(offset == -1))
 		return -1;
+	if (unlikely(offset > chunk_pos))
+		return unzip_hist_match(control, len, offset - chunk_pos, tally);
 	if (unlikely(seekto_fdhist(control, cur_pos - offset) == -1))
 		fatal("Seek failed by %'d from %'d on history file in unzip_match\n",
 		      offset, cur_pos);
@@ -206,7 +256,7 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, int chunk_bytes
 	if (unlikely(n < 1))
 		fatal("Failed fd history in unzip_match due to corrupt archive\n");
 
-	buf = (uchar *)malloc(n);
+	buf = (uchar *)malloc(len);
 	if (unlikely(!buf))
 		fatal("Failed to malloc match buffer of size %'"PRId64"\n", len);
 
@@ -215,26 +265,23 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, int chunk_bytes
 		fatal("Failed to read %d bytes in unzip_match\n", n);
 	}
 
-	while (len) {
-		n = MIN(len, offset);
-		if (unlikely(n < 1))
-			fatal("Failed fd history in unzip_match due to corrupt archive\n");
+	/* A match closer than its length repeats the last offset bytes, as
+	 * runs of zeros are encoded. Build all of it by doubling the copy so
+	 * it is written at once. */
+	for (; n < len; n += MIN(n, len - n))
+		memcpy(buf + n, buf, MIN(n, len - n));
 
-		if (unlikely(write_1g(control, buf, (size_t)n) != (ssize_t)n)) {
-			dealloc(buf);
-			fatal("Failed to read %'d bytes in unzip_match\n", n);
-		}
-
-		if (!HAS_HASH)
-//			*cksum = CrcUpdate(*cksum, buf, n);
-			gcry_md_write(control->crc_handle, buf, n);
-		if (HAS_HASH)
-			gcry_md_write(control->hash_handle, buf, n);
-
-		len -= n;
-		total += n;
+	if (unlikely(write_1g(control, buf, (size_t)len) != (ssize_t)len)) {
+		dealloc(buf);
+		fatal("Failed to write %'"PRId64" bytes in unzip_match\n", len);
 	}
 
+	if (!HAS_HASH)
+		gcry_md_write(control->crc_handle, buf, len);
+	if (HAS_HASH)
+		gcry_md_write(control->hash_handle, buf, len);
+	total = len;
+
 	dealloc(buf);
 
 	return total;
@@ -242,12 +289,13 @@ static i64 unzip_match(rzip_control *control, void *ss, i64 len, int chunk_bytes
 
 void clear_rulist(rzip_control *control)
 {
+	wait_backend_pool(control);
+	release_buffer_pool(control);
 	while (control->ruhead) {
 		struct runzip_node *node = control->ruhead;
 		struct stream_info *sinfo = node->sinfo;
 
 		dealloc(sinfo->ucthreads);
-		dealloc(node->pthreads);
 		dealloc(sinfo->s);
 		dealloc(sinfo);
 		control->ruhead = node->prev;
@@ -294,6 +342,11 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 		/* Read in the stored chunk byte width from the file */
 		if (unlikely(read_1g(control, fd_in, &chunk_bytes, 1) != 1))
 			fatal("Failed to read chunk_bytes size in runzip_chunk\n");
+		/* Matches may reach into earlier chunks, keep their output */
+		if (chunk_bytes & CHUNK_HISTORY) {
+			control->flags |= FLAG_GLOBAL_INDEX;
+			chunk_bytes &= ~CHUNK_HISTORY;
+		}
 		if (unlikely(chunk_bytes < 1 || chunk_bytes > 8))
 			fatal("chunk_bytes %'d is invalid in runzip_chunk\n", chunk_bytes);
 	}
@@ -329,7 +382,7 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 				break;
 
 			default:
-				u = unzip_match(control, ss, len, chunk_bytes);
+				u = unzip_match(control, ss, len, chunk_bytes, total, tally);
 				if (unlikely(u == -1)) {
 					close_stream_in(control, ss);
 					return -1;
@@ -369,6 +422,65 @@ static i64 runzip_chunk(rzip_control *control, int fd_in, i64 expected_size, i64
 	return total;
 }
 
+static bool write_history(rzip_control *control, uchar *buf, i64 len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(control->glob_fd, buf, MIN(len, ONE_MB));
+		if (unlikely(ret < 1)) {
+			print_err("Failed to write history file: %s\n", strerror(errno));
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/* When matches reach into earlier chunks and the output can't be read back,
+ * because it goes to stdout or is only tested, the len bytes of each chunk
+ * are kept in a temporary file before they are flushed */
+static bool save_history(rzip_control *control, int fd_out, i64 len)
+{
+	uchar *buf;
+	struct stat st;
+	i64 pos, n;
+	bool ret = true;
+
+	if (!GLOBAL_INDEX || !(STDOUT || TEST_ONLY) || !len)
+		return true;
+	if (control->glob_fd == -1) {
+		char *name = malloc(strlen(control->tmpdir) + 16);
+
+		if (unlikely(!name))
+			fatal("Failed to allocate history file name\n");
+		sprintf(name, "%slrziphist.XXXXXX", control->tmpdir);
+		control->glob_fd = mkstemp(name);
+		if (unlikely(control->glob_fd == -1))
+			fatal("Failed to create history file %s\n", name);
+		unlink(name);
+		dealloc(name);
+	}
+	if (TMP_OUTBUF)
+		return write_history(control, control->tmp_outbuf + control->out_len - len, len);
+
+	/* The chunk is at the end of the temporary output file */
+	if (unlikely(fstat(fd_out, &st)))
+		fatal("Failed to stat temporary output file in save_history\n");
+	buf = malloc(ONE_MB);
+	if (unlikely(!buf))
+		fatal("Failed to malloc history buffer\n");
+	for (pos = st.st_size - len; ret && pos < st.st_size; pos += n) {
+		n = pread(fd_out, buf, MIN(st.st_size - pos, ONE_MB), pos);
+		if (unlikely(n < 1))
+			fatal("Failed to read temporary output file in save_history\n");
+		ret = write_history(control, buf, n);
+	}
+	dealloc(buf);
+	return ret;
+}
+
 /* Decompress an open file. Call fatal_return(() on error
    return the number of bytes that have been retrieved
  */
@@ -377,10 +489,26 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 	uchar *hash_stored;
 	struct timeval start,end;
 	i64 total = 0, u;
+	struct stat st;
 	double tdiff;
 
 	hash_stored = calloc(*control->hash_len, 1);
 
+	if (control->ref_name) {
+		struct stat rs;
+
+		control->ref_fd = open(control->ref_name, O_RDONLY);
+		if (unlikely(control->ref_fd == -1 || fstat(control->ref_fd, &rs)))
+			fatal("Failed to open reference file %s\n", control->ref_name);
+		control->ref_size = rs.st_size;
+	}
+	/* Output written to a file is read back for matches into earlier
+	 * chunks, otherwise save_history keeps a copy */
+	if (!(STDOUT || TEST_ONLY))
+		control->glob_fd = fd_hist;
+	/* Pages of zeros written to a regular file are left as holes */
+	control->sparse = !(STDOUT || TEST_ONLY) && !fstat(fd_out, &st) && S_ISREG(st.st_mode);
+
 	gcry_md_open(&control->crc_handle, *control->crc_gcode, GCRY_MD_FLAG_SECURE);
 	if (HAS_HASH) {
 		gcry_md_open(&control->hash_handle, *control->hash_gcode, GCRY_MD_FLAG_SECURE);
@@ -398,6 +526,10 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 			}
 		}
 		total += u;
+		if (unlikely(!save_history(control, fd_out, u))) {
+			print_err("Failed to save_history in runzip_fd\n");
+			return -1;
+		}
 		if (TMP_OUTBUF) {
 			if (unlikely(!flush_tmpoutbuf(control))) {
 				print_err("Failed to flush_tmpoutbuf in runzip_fd\n");
@@ -411,7 +543,7 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 		}
 		if (TMP_INBUF)
 			clear_tmpinbuf(control);
-		else if (STDIN && !DECOMPRESS) {
+		else if (STDIN && !DECOMPRESS && control->minor_version < 15) {
 			if (unlikely(!clear_tmpinfile(control))) {
 				print_err("Failed to clear_tmpinfile in runzip_fd\n");
 				return -1;
@@ -497,6 +629,15 @@ i64 runzip_fd(rzip_control *control, int fd_in, int fd_out, int fd_hist, i64 exp
 				"calculated on decompression\n");
 
 	free(hash_stored);
+	dealloc(control->chunk_list);
+	control->chunk_count = 0;
+	if (control->ref_fd != -1) {
+		close(control->ref_fd);
+		control->ref_fd = -1;
+	}
+	if (control->glob_fd != -1 && (STDOUT || TEST_ONLY))
+		close(control->glob_fd);
+	control->glob_fd = -1;
 
 	return total;
 }
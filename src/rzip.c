@@ -40,6 +40,12 @@
 #include "stream.h"
 #include "util.h"
 #include "lrzip_core.h"
+#include "CpuArch.h"
+
+#if defined(MY_CPU_X86_OR_AMD64) && defined(__GNUC__)
+# define MATCH_SIMD
+# include <immintrin.h>
+#endif
 
 #ifndef MAP_ANONYMOUS
 # define MAP_ANONYMOUS MAP_ANON
@@ -49,6 +55,9 @@
 #define CKSUM_CHUNK ONE_MB
 #define GREAT_MATCH 1024
 #define MINIMUM_MATCH 31
+#define SEARCH_ROUND (4 * ONE_MB)
+#define STDIN_READ ONE_MB
+#define STDIN_AHEAD (4 * ONE_MB)
 
 /* Hash table works as follows.  We start by throwing tags at every
  * offset into the table.  As it fills, we start eliminating tags
@@ -57,28 +66,141 @@
  * that on average, all parts of the file are covered by the hash, if
  * sparsely. */
 
+/* Entries are packed into 64 bits. The offset takes the low 40 bits. Above
+ * it go the number of low bits of the tag set to one, which is all cleaning
+ * needs to know, and a fingerprint of 18 high bits of the tag. Eight entries
+ * fill a cache line and a bucket is one aligned line, so a search usually
+ * touches a single line. */
+#define HASH_OFFSET_BITS 40
+#define HASH_OFFSET_MASK ((1ULL << HASH_OFFSET_BITS) - 1)
+#define HASH_MAX_OFFSET (1LL << HASH_OFFSET_BITS)
+#define HASH_BITNESS_SHIFT HASH_OFFSET_BITS
+#define HASH_FP_SHIFT 46
+#define HASH_FP_TAG_SHIFT 28
+#define HASH_BUCKET_BITS 3
+#define HASH_ALIGN 64
+#define HASH_MIX 0x9E3779B97F4A7C15ULL
+
 /* All zero means empty.  We might miss the first chunk this way. */
 struct hash_entry {
-	i64 offset;
-	tag t;
+	uint64_t v;
 };
 
-/* Levels control hashtable size and bzip2 level. */
+/* Levels control hashtable size and bzip2 level. Levels with a ram_shift
+ * grow the hash table beyond mb_used with the chunk size, up to maxram
+ * shifted right by ram_shift. Levels with lazy keep up to that many match
+ * candidates before choosing which to encode, see lazy_commit. Levels with
+ * cdc_bits cut the chunk into pieces of about 1 << cdc_bits bytes by content
+ * and use the hash table as an index of their fingerprints, see dedup_search. */
 static struct level {
 	unsigned long mb_used;
 	unsigned initial_freq;
 	unsigned max_chain_len;
-} levels[10] = {
-	{ 1, 4, 1 },
-	{ 2, 4, 2 },
-	{ 4, 4, 2 },
-	{ 8, 4, 2 },
-	{ 16, 4, 3 },
-	{ 32, 4, 4 },
-	{ 32, 2, 6 },
-	{ 64, 1, 16 }, /* More MB makes sense, but need bigger test files */
-	{ 64, 1, 32 },
-	{ 64, 1, 128 },
+	unsigned ram_shift;
+	unsigned lazy;
+	unsigned cdc_bits;
+} levels[11] = {
+	{ 1, 4, 1, 0, 0, 0 },
+	{ 2, 4, 2, 0, 0, 0 },
+	{ 4, 4, 2, 0, 0, 0 },
+	{ 8, 4, 2, 0, 0, 0 },
+	{ 16, 4, 3, 0, 0, 0 },
+	{ 32, 4, 4, 0, 0, 0 },
+	{ 32, 2, 6, 0, 0, 0 },
+	{ 64, 1, 16, 4, 0, 0 },
+	{ 64, 1, 32, 3, 0, 0 },
+	{ 64, 1, 128, 2, 4, 0 },
+	{ 1, 1, 0, 5, 0, 8 },
+};
+
+/* A scaled hash table gets one byte per HASH_CHUNK_RATIO bytes of chunk,
+ * which is one entry every 16 bytes, and never more than 1 << HASH_MAX_BITS
+ * entries. */
+#define HASH_CHUNK_RATIO 2
+#define HASH_MAX_BITS 30
+
+struct rzip_match {
+	i64 p;
+	i64 ofs;
+	i64 len;
+};
+
+#define LAZY_MAX 8
+
+/* Match candidates of the lazy parse, in order of where they end */
+struct lazy_window {
+	struct rzip_match m[LAZY_MAX];
+	int n;
+};
+
+#define TAG_BLOCK 4096
+#define PREFETCH_AHEAD 16
+
+/* Content defined pieces of the dedup level are cut no sooner than
+ * CDC_MIN_SIZE and no later than CDC_MAX_SIZE bytes apart. The gear hash
+ * only depends on the last 64 bytes, so hashing starts that far before
+ * the earliest cut. */
+#define CDC_MIN_SIZE 256
+#define CDC_MAX_SIZE (16 * 1024)
+#define CDC_WINDOW 64
+
+static uint64_t cdc_gear[256];
+
+/* With -R auto, the level of each chunk is chosen from a sample of its
+ * first 1 << AUTO_SAMPLE_SHIFT part, at least AUTO_SAMPLE_MIN and at most
+ * AUTO_SAMPLE_MAX bytes. Probes are taken at content defined anchors every
+ * 1 << AUTO_PROBE_BITS bytes or so and pieces are cut as the dedup level
+ * does, both remembered in tables of fingerprints sized for the sample, of
+ * at most 1 << AUTO_TABLE_BITS. */
+#define AUTO_SAMPLE_SHIFT 5
+#define AUTO_SAMPLE_MIN ONE_MB
+#define AUTO_SAMPLE_MAX (64 * ONE_MB)
+#define AUTO_PROBE_BITS 5
+#define AUTO_PIECE_BITS 8
+#define AUTO_TABLE_BITS 22
+
+/* Runs of zeros of at least ZERO_RUN_MIN bytes are encoded without being
+ * searched. They are looked for ZERO_PROBE bytes at a time at the start of
+ * each block or dedup piece. */
+#define ZERO_RUN_MIN 4096
+#define ZERO_PROBE 64
+#define ZERO_PAGE 4096
+
+/* Tags and candidate positions of one block of the search */
+struct tag_block {
+	tag prefix[TAG_BLOCK + MINIMUM_MATCH];
+	uchar bytes[TAG_BLOCK + MINIMUM_MATCH];
+	i64 pos[TAG_BLOCK];
+	tag t[TAG_BLOCK];
+	int ncand;
+	bool mapped;	/* The whole chunk is in buf_low */
+};
+
+struct search_pool;
+
+/* A thread of the parallel match search. It owns one partition of the tag
+ * space and a private hash table for it. Candidates alternate between two
+ * lists so one round can be merged while the next is searched. */
+struct search_thread {
+	struct search_pool *pool;
+	pthread_t pthread;
+	cksem_t start;
+	struct rzip_state st;
+	int id;
+	tag tag_mask;
+	struct rzip_match *cand[2];
+	i64 ncand[2];
+	i64 maxcand[2];
+};
+
+struct search_pool {
+	rzip_control *control;
+	struct search_thread *sths;
+	int nthreads;
+	cksem_t done;
+	i64 end;
+	i64 round_end;
+	int round;
 };
 
 static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
@@ -98,45 +220,88 @@ static void remap_low_sb(rzip_control *control, struct sliding_buffer *sb)
 		fatal("Failed to re mmap in remap_low_sb\n");
 }
 
-static inline void remap_high_sb(rzip_control *control, struct sliding_buffer *sb, i64 p)
+/* Return the high window holding p, or NULL if it is not mapped */
+static inline struct sb_window *find_high_sb(struct sliding_buffer *sb, i64 p)
 {
-	if (unlikely(munmap(sb->buf_high, sb->size_high)))
+	struct sb_window *w = sb->last_high;
+	int i;
+
+	if (w && p >= w->offset && p < w->offset + w->size)
+		return w;
+	for (i = 0, w = sb->high; i < SB_WINDOWS; i++, w++) {
+		if (w->buf && p >= w->offset && p < w->offset + w->size)
+			return w;
+	}
+	return NULL;
+}
+
+/* Map the window holding p in place of the least recently used one. Windows
+ * are aligned to their own size in the file so they never overlap. When the
+ * new window directly follows one already mapped the access is likely to be
+ * sequential, and the window after it is read ahead. */
+static struct sb_window *remap_high_sb(rzip_control *control, struct sliding_buffer *sb, i64 p)
+{
+	struct sb_window *w = sb->high, *lru = sb->high;
+	int i;
+
+	for (i = 0; i < SB_WINDOWS; i++, w++) {
+		if (!w->buf) {
+			lru = w;
+			break;
+		}
+		if (w->last_use < lru->last_use)
+			lru = w;
+	}
+	if (lru->buf && unlikely(munmap(lru->buf, lru->size)))
 		fatal("Failed to munmap in remap_high_sb\n");
-	sb->size_high = sb->high_length; /* In case we shrunk it when we hit the end of the file */
-	sb->offset_high = p;
-	/* Make sure offset is rounded to page size of total offset */
-	sb->offset_high -= (sb->offset_high + sb->orig_offset) % control->page_size;
-	if (unlikely(sb->offset_high + sb->size_high > sb->orig_size))
-		sb->size_high = sb->orig_size - sb->offset_high;
-	sb->buf_high = (uchar *)mmap(sb->buf_high, sb->size_high, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + sb->offset_high);
-	if (unlikely(sb->buf_high == MAP_FAILED))
+
+	sb->high_misses++;
+	lru->offset = p - (p + sb->orig_offset) % sb->high_length;
+	lru->size = sb->high_length;
+	if (unlikely(lru->offset + lru->size > sb->orig_size))
+		lru->size = sb->orig_size - lru->offset;
+	lru->buf = (uchar *)mmap(NULL, lru->size, PROT_READ, MAP_SHARED, sb->fd, sb->orig_offset + lru->offset);
+	if (unlikely(lru->buf == MAP_FAILED))
 		fatal("Failed to re mmap in remap_high_sb\n");
+
+	if (lru->offset > 0 && lru->offset + lru->size < sb->orig_size &&
+	    find_high_sb(sb, lru->offset - 1)) {
+		posix_fadvise(sb->fd, sb->orig_offset + lru->offset + lru->size,
+			      MIN(sb->high_length, sb->orig_size - lru->offset - lru->size),
+			      POSIX_FADV_WILLNEED);
+		sb->readaheads++;
+	}
+	return lru;
 }
 
 /* We use a "sliding mmap" to effectively read more than we can fit into the
  * compression window. This is done by using a maximally sized lower mmap at
  * the beginning of the block which slides up once the hash search moves beyond
- * it, and a 64k mmap block that slides up and down as is required for any
- * offsets outside the range of the lower one. This is much slower than mmap
- * but makes it possible to have unlimited sized compression windows.
+ * it, and a set of SB_WINDOWS high windows that are remapped in least recently
+ * used order as is required for any offsets outside the range of the lower
+ * one. This is slower than mmap but makes it possible to have unlimited sized
+ * compression windows.
  * We use a pointer to the function we actually want to use and only enable
  * the sliding mmap version if we need sliding mmap functionality as this is
  * a hot function during the rzip phase */
 static uchar *sliding_get_sb(rzip_control *control, i64 p)
 {
 	struct sliding_buffer *sb = &control->sb;
+	struct sb_window *w;
 	i64 sbo;
 
 	sbo = sb->offset_low;
 	if (p >= sbo && p < sbo + sb->size_low)
 		return (sb->buf_low + p - sbo);
-	sbo = sb->offset_high;
-	if (p >= sbo && p < (sbo + sb->size_high))
-		return (sb->buf_high + (p - sbo));
-	/* p is not within the low or high buffer range */
-	remap_high_sb(control, &control->sb, p);
-	/* Use sb->offset_high directly since it will have changed */
-	return (sb->buf_high + (p - sb->offset_high));
+	w = find_high_sb(sb, p);
+	if (likely(w))
+		sb->high_hits++;
+	else
+		/* p is not within the low buffer or any high window */
+		w = remap_high_sb(control, sb, p);
+	w->last_use = ++sb->use_count;
+	sb->last_high = w;
+	return (w->buf + (p - w->offset));
 }
 
 /* The length of continous range of the sliding buffer,
@@ -145,18 +310,46 @@ static uchar *sliding_get_sb(rzip_control *control, i64 p)
 static inline i64 sliding_get_sb_range(rzip_control *control, i64 p)
 {
 	struct sliding_buffer *sb = &control->sb;
+	struct sb_window *w;
 	i64 sbo, sbs;
 
 	sbo = sb->offset_low;
 	sbs = sb->size_low;
 	if (p >= sbo && p < sbo + sbs)
 		return (sbs - (p - sbo));
-	sbo = sb->offset_high;
-	sbs = sb->size_high;
-	if (likely(p >= sbo && p < (sbo + sbs)))
-		return (sbs - (p - sbo));
+	w = find_high_sb(sb, p);
+	if (likely(w))
+		return (w->size - (p - w->offset));
 
 	fatal("sliding_get_sb_range: the pointer is out of range\n");
+	return 0;	/* not reached */
+}
+
+/* The length of continous range of the sliding buffer,
+ * ending at the offset P inclusive.
+ */
+static inline i64 sliding_get_sb_rrange(rzip_control *control, i64 p)
+{
+	struct sliding_buffer *sb = &control->sb;
+	struct sb_window *w;
+	i64 sbo, sbs;
+
+	sbo = sb->offset_low;
+	sbs = sb->size_low;
+	if (p >= sbo && p < sbo + sbs)
+		return (p - sbo + 1);
+	w = find_high_sb(sb, p);
+	if (likely(w))
+		return (p - w->offset + 1);
+
+	fatal("sliding_get_sb_rrange: the pointer is out of range\n");
+	return 0;	/* not reached */
+}
+
+static inline bool sliding_mapped(struct sliding_buffer *sb, i64 p)
+{
+	return (p >= sb->offset_low && p < sb->offset_low + sb->size_low) ||
+		find_high_sb(sb, p);
 }
 
 /* Since the sliding get_sb only allows us to access one byte at a time, we
@@ -180,6 +373,204 @@ static void sliding_mcpy(rzip_control *control, unsigned char *buf, i64 offset,
 	}
 }
 
+/* Match extension kernels. fwd_match returns how many bytes are equal from
+ * the start of a and b, rev_match how many are equal going backwards from
+ * just before a and b, comparing at most max bytes. The vector versions are
+ * chosen at runtime in init_match_kernels. */
+static i64 (*fwd_match)(const uchar *a, const uchar *b, i64 max);
+static i64 (*rev_match)(const uchar *a, const uchar *b, i64 max);
+
+static i64 scalar_fwd_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (n + 8 <= max) {
+		uint64_t x, y;
+
+		memcpy(&x, a + n, 8);
+		memcpy(&y, b + n, 8);
+		if (x != y)
+			return n + (__builtin_ctzll(x ^ y) >> 3);
+		n += 8;
+	}
+#endif
+	while (n < max && a[n] == b[n])
+		n++;
+	return n;
+}
+
+static i64 scalar_rev_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (n + 8 <= max) {
+		uint64_t x, y;
+
+		memcpy(&x, a - n - 8, 8);
+		memcpy(&y, b - n - 8, 8);
+		if (x != y)
+			return n + (__builtin_clzll(x ^ y) >> 3);
+		n += 8;
+	}
+#endif
+	while (n < max && a[-n - 1] == b[-n - 1])
+		n++;
+	return n;
+}
+
+#ifdef MATCH_SIMD
+__attribute__((target("sse2")))
+static i64 sse2_fwd_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+	while (n + 16 <= max) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + n));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + n));
+		unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+
+		if (diff)
+			return n + __builtin_ctz(diff);
+		n += 16;
+	}
+	return n + scalar_fwd_match(a + n, b + n, max - n);
+}
+
+__attribute__((target("sse2")))
+static i64 sse2_rev_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+	while (n + 16 <= max) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a - n - 16));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b - n - 16));
+		unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+
+		if (diff)
+			return n + __builtin_clz(diff) - 16;
+		n += 16;
+	}
+	return n + scalar_rev_match(a - n, b - n, max - n);
+}
+
+__attribute__((target("avx2")))
+static i64 avx2_fwd_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+	while (n + 32 <= max) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + n));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + n));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+		if (diff)
+			return n + __builtin_ctz(diff);
+		n += 32;
+	}
+	return n + sse2_fwd_match(a + n, b + n, max - n);
+}
+
+__attribute__((target("avx2")))
+static i64 avx2_rev_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+	while (n + 32 <= max) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a - n - 32));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b - n - 32));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+		if (diff)
+			return n + __builtin_clz(diff);
+		n += 32;
+	}
+	return n + sse2_rev_match(a - n, b - n, max - n);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static i64 avx512_fwd_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+	while (n + 64 <= max) {
+		__m512i x = _mm512_loadu_si512((const void *)(a + n));
+		__m512i y = _mm512_loadu_si512((const void *)(b + n));
+		uint64_t diff = _mm512_cmpneq_epi8_mask(x, y);
+
+		if (diff)
+			return n + __builtin_ctzll(diff);
+		n += 64;
+	}
+	return n + avx2_fwd_match(a + n, b + n, max - n);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static i64 avx512_rev_match(const uchar *a, const uchar *b, i64 max)
+{
+	i64 n = 0;
+
+	while (n + 64 <= max) {
+		__m512i x = _mm512_loadu_si512((const void *)(a - n - 64));
+		__m512i y = _mm512_loadu_si512((const void *)(b - n - 64));
+		uint64_t diff = _mm512_cmpneq_epi8_mask(x, y);
+
+		if (diff)
+			return n + __builtin_clzll(diff);
+		n += 64;
+	}
+	return n + avx2_rev_match(a - n, b - n, max - n);
+}
+#endif
+
+static void init_match_kernels(rzip_control *control)
+{
+	const char *kernel = "scalar";
+
+	fwd_match = scalar_fwd_match;
+	rev_match = scalar_rev_match;
+#ifdef MATCH_SIMD
+	/* CpuArch has no AVX-512BW test, so ask the compiler runtime for
+	 * that one. It also checks the OS saves the zmm registers. */
+	if (CPU_IsSupported_AVX2() && __builtin_cpu_supports("avx512bw")) {
+		fwd_match = avx512_fwd_match;
+		rev_match = avx512_rev_match;
+		kernel = "AVX-512";
+	} else if (CPU_IsSupported_AVX2()) {
+		fwd_match = avx2_fwd_match;
+		rev_match = avx2_rev_match;
+		kernel = "AVX2";
+	} else {
+# ifndef MY_CPU_AMD64
+		if (CPU_IsSupported_SSE2())
+# endif
+		{
+			fwd_match = sse2_fwd_match;
+			rev_match = sse2_rev_match;
+			kernel = "SSE2";
+		}
+	}
+#endif
+	print_maxverbose("Using %s match extension\n", kernel);
+}
+
+/* Fill the gear table from a fixed seed so the same input is always cut
+ * the same way */
+static void init_cdc_gear(void)
+{
+	uint64_t x = HASH_MIX;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		uint64_t z = (x += HASH_MIX);
+
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		cdc_gear[i] = z ^ (z >> 31);
+	}
+}
+
 /* All put_u8/u32/vchars go to stream 0 */
 static inline void put_u8(rzip_control *control, void *ss, uchar b)
 {
@@ -217,8 +608,6 @@ static inline void put_match(rzip_control *control, struct rzip_state *st,
 		ofs = (p - offset);
 		put_header(control, st->ss, 1, n);
 		put_vchars(control, st->ss, ofs, st->chunk_bytes);
-		st->stats.matches++;
-		st->stats.match_bytes += n;
 		len -= n;
 		p += n;
 		offset += n;
@@ -247,15 +636,16 @@ static inline void write_sbstream(rzip_control *control, void *ss, int stream,
 
 static void put_literal(rzip_control *control, struct rzip_state *st, i64 last, i64 p)
 {
+	if (p > last) {
+		st->stats.literals++;
+		st->stats.literal_bytes += p - last;
+	}
 	do {
 		i64 len = p - last;
 
 		if (len > 0xFFFF)
 			len = 0xFFFF;
 
-		st->stats.literals++;
-		st->stats.literal_bytes += len;
-
 		put_header(control, st->ss, 0, len);
 
 		if (len)
@@ -267,36 +657,54 @@ static void put_literal(rzip_control *control, struct rzip_state *st, i64 last,
 /* Could give false positive on offset 0.  Who cares. */
 static inline bool empty_hash(struct hash_entry *he)
 {
-	return !(he->offset | he->t);
+	return !he->v;
 }
 
-static i64 primary_hash(struct rzip_state *st, tag t)
+/* Number of low bits set to one */
+static inline unsigned tag_bitness(tag t)
 {
-	return t & ((1 << st->hash_bits) - 1);
+	return ffsll(~t) - 1;
 }
 
-static inline tag increase_mask(tag tag_mask)
+/* The entry for a tag without its offset */
+static inline uint64_t hash_key(tag t)
 {
-	/* Get more precise. */
-	return (tag_mask << 1) | 1;
+	return (uint64_t)tag_bitness(t) << HASH_BITNESS_SHIFT |
+		((uint64_t)t >> HASH_FP_TAG_SHIFT) << HASH_FP_SHIFT;
 }
 
-static inline bool minimum_bitness(struct rzip_state *st, tag t)
+static inline uint64_t entry_key(struct hash_entry *he)
 {
-	tag better_than_min = increase_mask(st->minimum_tag_mask);
+	return he->v & ~HASH_OFFSET_MASK;
+}
 
-	if ((t & better_than_min) != better_than_min)
-		return true;
-	return false;
+static inline i64 entry_offset(struct hash_entry *he)
+{
+	return he->v & HASH_OFFSET_MASK;
+}
+
+static inline unsigned entry_bitness(struct hash_entry *he)
+{
+	return (he->v >> HASH_BITNESS_SHIFT) & 0x3F;
+}
+
+/* First slot of the bucket of a tag. The low bits of the tags kept in the
+ * table are mostly set to one, so all bits are mixed to choose a bucket. */
+static i64 primary_hash(struct rzip_state *st, tag t)
+{
+	return ((uint64_t)t * HASH_MIX) >> (64 - st->hash_bits + HASH_BUCKET_BITS) << HASH_BUCKET_BITS;
+}
+
+static inline tag increase_mask(tag tag_mask)
+{
+	/* Get more precise. */
+	return (tag_mask << 1) | 1;
 }
 
-/* Is a going to be cleaned before b?  ie. does a have fewer low bits
- * set than b? */
-static inline bool lesser_bitness(tag a, tag b)
+/* Is this entry due for cleaning? */
+static inline bool minimum_bitness(struct rzip_state *st, struct hash_entry *he)
 {
-	a ^= 0xffffffffffffffff;
-	b ^= 0xffffffffffffffff;
-	return (ffsll(a) < ffsll(b));
+	return entry_bitness(he) < tag_bitness(increase_mask(st->minimum_tag_mask));
 }
 
 /* If hash bucket is taken, we spill into next bucket(s).  Secondary hashing
@@ -304,8 +712,7 @@ static inline bool lesser_bitness(tag a, tag b)
 static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 {
 	i64 h, victim_h = 0, round = 0;
-	/* If we need to kill one, this will be it. */
-	static i64 victim_round = 0;
+	uint64_t entry = hash_key(t) | offset;
 	struct hash_entry *he;
 
 	h = primary_hash(st, t);
@@ -313,32 +720,34 @@ static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 	while (!empty_hash(he)) {
 		/* If this due for cleaning anyway, just replace it:
 		   rehashing might move it behind tag_clean_ptr. */
-		if (minimum_bitness(st, he->t)) {
+		if (minimum_bitness(st, he)) {
 			st->hash_count--;
 			break;
 		}
 		/* If we are better than current occupant, we can't
 		   jump over it: it will be cleaned before us, and
-		   noone would then find us in the hash table.  Rehash
-		   it, then take its place. */
-		if (lesser_bitness(he->t, t)) {
-			insert_hash(st, he->t,
-				    he->offset);
-			break;
-		}
-
-		/* If we have lots of identical patterns, we end up
-		   with lots of the same hash number.  Discard random. */
-		if (he->t == t) {
-			if (round == victim_round)
+		   noone would then find us in the hash table.  Take
+		   its place and carry it further down the chain, which
+		   is as far as any search for it could reach. */
+		if (entry_bitness(he) < (entry >> HASH_BITNESS_SHIFT & 0x3F)) {
+			uint64_t displaced = he->v;
+
+			he->v = entry;
+			entry = displaced;
+			victim_h = round = 0;
+		} else if (entry_key(he) == (entry & ~HASH_OFFSET_MASK)) {
+			/* If we have lots of identical patterns, we end up
+			   with lots of the same hash number.  Discard random. */
+			/* If we need to kill one, this will be it. */
+			if (round == st->victim_round)
 				victim_h = h;
 			if (++round == st->level->max_chain_len) {
 				h = victim_h;
 				he = &st->hash_table[h];
 				st->hash_count--;
-				victim_round++;
-				if (victim_round == st->level->max_chain_len)
-					victim_round = 0;
+				st->victim_round++;
+				if (st->victim_round == st->level->max_chain_len)
+					st->victim_round = 0;
 				break;
 			}
 		}
@@ -348,8 +757,7 @@ static void insert_hash(struct rzip_state *st, tag t, i64 offset)
 		he = &st->hash_table[h];
 	}
 
-	he->t = t;
-	he->offset = offset;
+	he->v = entry;
 }
 
 /* Eliminate one hash entry with minimum number of lower bits set.
@@ -368,9 +776,8 @@ again:
 		he = &st->hash_table[st->tag_clean_ptr];
 		if (empty_hash(he))
 			continue;
-		if ((he->t & better_than_min) != better_than_min) {
-			he->offset = 0;
-			he->t = 0;
+		if (minimum_bitness(st, he)) {
+			he->v = 0;
 			st->hash_count--;
 			return better_than_min;
 		}
@@ -378,114 +785,233 @@ again:
 
 	/* We hit the end: everthing in hash satisfies the better mask. */
 	st->minimum_tag_mask = better_than_min;
+	st->stats.mask_escalations++;
 	st->tag_clean_ptr = 0;
 	goto again;
 }
 
-static void single_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t)
+/* Tags are computed for a block of positions at a time. The tag of a
+ * position is the XOR of the hash_index values of the MINIMUM_MATCH bytes
+ * starting there, which is the XOR of two prefix values that differ by
+ * MINIMUM_MATCH. Building the prefix takes one table lookup per byte, and
+ * the tags then fall out of a loop without any dependency between
+ * positions. Only the positions whose tag passes the minimum mask are kept
+ * as candidates, and since a tag depends on its position only, nothing is
+ * recomputed when the search skips over a match. */
+static void fill_tag_block(rzip_control *control, struct rzip_state *st,
+			   struct tag_block *tb, i64 first, i64 n)
 {
-	uchar u;
+	tag *prefix = tb->prefix, mask = st->minimum_tag_mask;
+	i64 i, len = n + MINIMUM_MATCH - 1;
+	const uchar *buf;
+	int ncand = 0;
+
+	tb->mapped = st->mmap_size >= st->chunk_size;
+	if (tb->mapped)
+		buf = control->sb.buf_low + first;
+	else {
+		control->do_mcpy(control, tb->bytes, first, len);
+		buf = tb->bytes;
+	}
 
-	u = control->sb.buf_low[p - 1];
-	*t ^= st->hash_index[u];
-	u = control->sb.buf_low[p + MINIMUM_MATCH - 1];
-	*t ^= st->hash_index[u];
-}
+	prefix[0] = 0;
+	for (i = 0; i < len; i++)
+		prefix[i + 1] = prefix[i] ^ st->hash_index[buf[i]];
 
-static void sliding_next_tag(rzip_control *control, struct rzip_state *st, i64 p, tag *t)
-{
-	uchar *u;
+	for (i = 0; i < n; i++) {
+		tag t = prefix[i + MINIMUM_MATCH] ^ prefix[i];
 
-	u = sliding_get_sb(control, p - 1);
-	*t ^= st->hash_index[*u];
-	u = sliding_get_sb(control, p + MINIMUM_MATCH - 1);
-	*t ^= st->hash_index[*u];
+		tb->pos[ncand] = first + i;
+		tb->t[ncand] = t;
+		ncand += (t & mask) == mask;
+	}
+	tb->ncand = ncand;
 }
 
-static tag single_full_tag(rzip_control *control, struct rzip_state *st, i64 p)
+/* Prefetch the bucket of the candidate PREFETCH_AHEAD places after the one
+ * about to be searched. For the candidate half as far ahead, whose bucket
+ * should have arrived by now, also prefetch the data at the first entry with
+ * a matching key, so that the probes rarely wait on memory. */
+static inline void prefetch_candidates(rzip_control *control, struct rzip_state *st,
+				       struct tag_block *tb, int i)
 {
-	tag ret = 0;
-	int i;
-	uchar u;
-
-	for (i = 0; i < MINIMUM_MATCH; i++) {
-		u = control->sb.buf_low[p + i];
-		ret ^= st->hash_index[u];
+	struct hash_entry *he;
+	uint64_t key;
+	int j;
+
+	if (i + PREFETCH_AHEAD < tb->ncand)
+		__builtin_prefetch(&st->hash_table[primary_hash(st, tb->t[i + PREFETCH_AHEAD])]);
+	if (!tb->mapped || i + PREFETCH_AHEAD / 2 >= tb->ncand)
+		return;
+	key = hash_key(tb->t[i + PREFETCH_AHEAD / 2]);
+	he = &st->hash_table[primary_hash(st, tb->t[i + PREFETCH_AHEAD / 2])];
+	for (j = 0; j < 1 << HASH_BUCKET_BITS && !empty_hash(&he[j]); j++) {
+		if (entry_key(&he[j]) == key) {
+			if (entry_offset(&he[j]) < st->ref_base)
+				__builtin_prefetch(control->sb.buf_low + entry_offset(&he[j]));
+			break;
+		}
 	}
-	return ret;
 }
 
-static tag sliding_full_tag(rzip_control *control, struct rzip_state *st, i64 p)
+static struct tag_block *alloc_tag_block(rzip_control *control)
 {
-	tag ret = 0;
-	int i;
-	uchar *u;
+	struct tag_block *tb = malloc(sizeof(struct tag_block));
 
-	for (i = 0; i < MINIMUM_MATCH; i++) {
-		u = sliding_get_sb(control, p + i);
-		ret ^= st->hash_index[*u];
-	}
-	return ret;
+	if (unlikely(!tb))
+		fatal("Failed to malloc tag block in alloc_tag_block\n");
+	return tb;
 }
 
 static i64
 single_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
 		 i64 end, i64 *rev)
 {
-	i64 p, len;
+	uchar *buf = control->sb.buf_low;
+	i64 len;
 
 	if (op >= p0)
 		return 0;
 
-	p = p0;
-	while (p < end && control->sb.buf_low[p] == control->sb.buf_low[op]) {
-		p++;
-		op++;
-	}
-	len = p - p0;
-	p = p0;
-	op -= len;
+	len = fwd_match(buf + p0, buf + op, end - p0);
 
 	end = MAX(0, st->last_match);
+	if (p0 > end)
+		*rev = rev_match(buf + p0, buf + op, MIN(p0 - end, op));
+	else
+		*rev = 0;
 
-	while (p > end && op > 0 && control->sb.buf_low[op - 1] == control->sb.buf_low[p - 1]) {
-		op--;
-		p--;
-	}
-
-	len += *rev = p0 - p;
+	len += *rev;
 	if (len < MINIMUM_MATCH)
 		return 0;
 
 	return len;
 }
 
+/* Map x and y at the same time and return how many bytes onwards from both
+ * (backwards if rev is set) can be compared in place, or 0 if they can't be
+ * mapped together. */
+static i64 sliding_get_pair(rzip_control *control, i64 x, i64 y, bool rev,
+			    uchar **px, uchar **py)
+{
+	struct sliding_buffer *sb = &control->sb;
+	i64 rx, ry;
+
+	*py = sliding_get_sb(control, y);
+	*px = sliding_get_sb(control, x);
+	if (!sliding_mapped(sb, y))
+		return 0;
+	if (rev) {
+		rx = sliding_get_sb_rrange(control, x);
+		ry = sliding_get_sb_rrange(control, y);
+	} else {
+		rx = sliding_get_sb_range(control, x);
+		ry = sliding_get_sb_range(control, y);
+	}
+	return MIN(rx, ry);
+}
+
 static i64
 sliding_match_len(rzip_control *control, struct rzip_state *st, i64 p0, i64 op,
 		  i64 end, i64 *rev)
 {
-	i64 p, len;
+	i64 len, max, n, m;
+	uchar *a, *b;
 
 	if (op >= p0)
 		return 0;
 
-	p = p0;
-	while (p < end && *sliding_get_sb(control, p) == *sliding_get_sb(control, op)) {
-		p++;
-		op++;
+	/* Compare whole mapped runs, one byte at a time only where the two
+	 * sides can't be mapped together. */
+	len = 0;
+	max = end - p0;
+	while (len < max) {
+		m = sliding_get_pair(control, p0 + len, op + len, false, &a, &b);
+		if (!m) {
+			if (*sliding_get_sb(control, p0 + len) != *sliding_get_sb(control, op + len))
+				break;
+			len++;
+			continue;
+		}
+		m = MIN(m, max - len);
+		n = fwd_match(a, b, m);
+		len += n;
+		if (n < m)
+			break;
 	}
-	len = p - p0;
-	p = p0;
-	op -= len;
 
 	end = MAX(0, st->last_match);
+	*rev = 0;
+	max = p0 > end ? MIN(p0 - end, op) : 0;
+	while (*rev < max) {
+		i64 x = p0 - *rev - 1, y = op - *rev - 1;
+
+		m = sliding_get_pair(control, x, y, true, &a, &b);
+		if (!m) {
+			if (*sliding_get_sb(control, x) != *sliding_get_sb(control, y))
+				break;
+			(*rev)++;
+			continue;
+		}
+		m = MIN(m, max - *rev);
+		n = rev_match(a + 1, b + 1, m);
+		*rev += n;
+		if (n < m)
+			break;
+	}
+
+	len += *rev;
+	if (len < MINIMUM_MATCH)
+		return 0;
+
+	return len;
+}
+
+/* A run of the chunk that can be compared in place, starting at x, or
+ * ending at x when rev is set. */
+static inline i64 chunk_run(rzip_control *control, struct rzip_state *st, i64 x, bool rev,
+			    uchar **px)
+{
+	if (st->mmap_size >= st->chunk_size) {
+		*px = control->sb.buf_low + x;
+		return rev ? x + 1 : st->chunk_size - x;
+	}
+	*px = sliding_get_sb(control, x);
+	return rev ? sliding_get_sb_rrange(control, x) : sliding_get_sb_range(control, x);
+}
+
+/* The match length between the chunk at p0 and r in ref, either the
+ * reference file or the input before this chunk, of size bytes. Found the
+ * same way as single_match_len, and matches stay within ref. */
+static i64
+ref_match_len(rzip_control *control, struct rzip_state *st, i64 p0, uchar *ref,
+	      i64 r, i64 size, i64 end, i64 *rev)
+{
+	uchar *a;
+	i64 len, max, n, m;
+
+	len = 0;
+	max = MIN(end - p0, size - r);
+	while (len < max) {
+		m = MIN(chunk_run(control, st, p0 + len, false, &a), max - len);
+		n = fwd_match(a, ref + r + len, m);
+		len += n;
+		if (n < m)
+			break;
+	}
 
-	while (p > end && op > 0 && *sliding_get_sb(control, op - 1) == *sliding_get_sb(control, p - 1)) {
-		op--;
-		p--;
+	end = MAX(0, st->last_match);
+	*rev = 0;
+	max = p0 > end ? MIN(p0 - end, r) : 0;
+	while (*rev < max) {
+		m = MIN(chunk_run(control, st, p0 - *rev - 1, true, &a), max - *rev);
+		n = rev_match(a + 1, ref + r - *rev, m);
+		*rev += n;
+		if (n < m)
+			break;
 	}
 
-	len += *rev = p0 - p;
+	len += *rev;
 	if (len < MINIMUM_MATCH)
 		return 0;
 
@@ -497,6 +1023,7 @@ find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
 		i64 end, i64 *offset, i64 *reverse)
 {
 	struct hash_entry *he;
+	uint64_t key = hash_key(t);
 	i64 length = 0;
 	i64 rev;
 	i64 h;
@@ -511,13 +1038,28 @@ find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
 	while (!empty_hash(he)) {
 		i64 mlen;
 
-		if (t == he->t) {
-			mlen = control->match_len(control, st, p, he->offset, end,
-						  &rev);
+		if (entry_key(he) == key) {
+			i64 op = entry_offset(he);
+
+			/* Offsets in the reference file and the earlier
+			 * chunks become negative, as if they came just
+			 * before this chunk. */
+			if (unlikely(op >= st->ref_base)) {
+				op -= st->ref_base;
+				if (op < control->ref_size)
+					mlen = ref_match_len(control, st, p, control->ref_buf, op,
+							     control->ref_size, end, &rev);
+				else
+					mlen = ref_match_len(control, st, p, control->glob_buf,
+							     op - control->ref_size,
+							     st->hist_size - control->ref_size, end, &rev);
+				op -= st->hist_size;
+			} else
+				mlen = control->match_len(control, st, p, op, end, &rev);
 			if (mlen) {
 				if (mlen > length) {
 					length = mlen;
-					(*offset) = he->offset - rev;
+					(*offset) = op - rev;
 					(*reverse) = rev;
 				}
 				st->stats.tag_hits++;
@@ -535,18 +1077,18 @@ find_best_match(rzip_control *control, struct rzip_state *st, tag t, i64 p,
 
 static void show_distrib(rzip_control *control, struct rzip_state *st)
 {
-	struct hash_entry *he;
-	i64 primary = 0;
-	i64 total = 0;
-	i64 i;
-
-	for (i = 0; i < (1U << st->hash_bits); i++) {
-		he = &st->hash_table[i];
-		if (empty_hash(he))
-			continue;
-		total++;
-		if (primary_hash(st, he->t) == i)
-			primary++;
+	i64 buckets = 1 << (st->hash_bits - HASH_BUCKET_BITS);
+	i64 total = 0, full = 0;
+	i64 i, j;
+
+	for (i = 0; i < buckets; i++) {
+		i64 used = 0;
+
+		for (j = 0; j < 1 << HASH_BUCKET_BITS; j++)
+			used += !empty_hash(&st->hash_table[(i << HASH_BUCKET_BITS) + j]);
+		total += used;
+		if (used == 1 << HASH_BUCKET_BITS)
+			full++;
 	}
 
 	if (total != st->hash_count)
@@ -555,205 +1097,1569 @@ static void show_distrib(rzip_control *control, struct rzip_state *st)
 	if (!total)
 		print_output("0 total hashes\n");
 	else {
-		print_output("%'"PRId64" total hashes -- %'"PRId64" in primary bucket (%-2.3f%%)\n",
-			     total, primary, primary * 100.0 / total);
+		print_output("%'"PRId64" total hashes -- %-2.3f%% full, %'"PRId64" of %'"PRId64" buckets full\n",
+			     total, total * 100.0 / (buckets << HASH_BUCKET_BITS), full, buckets);
 	}
 }
 
-/* Perform all checksumming in a separate thread to speed up the hash search. */
-static void *cksumthread(void *data)
+/* Perform all checksumming in a separate thread to speed up the hash search.
+ * The worker lives as long as rzip_fd and hashes the slices of the ring in
+ * order until it gets an empty one. */
+static void *cksum_worker(void *data)
 {
 	rzip_control *control = (rzip_control *)data;
+	struct checksum *ck = &control->checksum;
+	struct cksum_slice *cs;
 
-	pthread_detach(pthread_self());
-
-//	*control->checksum.cksum = CrcUpdate(*control->checksum.cksum, control->checksum.buf, control->checksum.len);
-	gcry_md_write(control->crc_handle, control->checksum.buf, control->checksum.len);
-	if (HAS_HASH)
-		gcry_md_write(control->hash_handle, control->checksum.buf, control->checksum.len);
-	dealloc(control->checksum.buf);
-	cksem_post(control, &control->cksumsem);
+	while (42) {
+		cksem_wait(control, &ck->ready);
+		cs = &ck->ring[ck->tail++ % CKSUM_RING];
+		if (!cs->buf)
+			break;
+		gcry_md_write(control->crc_handle, cs->buf, cs->len);
+		if (HAS_HASH)
+			gcry_md_write(control->hash_handle, cs->buf, cs->len);
+		if (cs->owned)
+			dealloc(cs->buf);
+		cksem_post(control, &ck->room);
+	}
 	return NULL;
 }
 
-static inline void cksum_update(rzip_control *control)
+static void cksum_push(rzip_control *control, uchar *buf, i64 len, bool owned)
 {
-	pthread_t thread;
-
-	create_pthread(control, &thread, NULL, cksumthread, control);
+	struct checksum *ck = &control->checksum;
+	struct cksum_slice *cs;
+
+	cksem_wait(control, &ck->room);
+	cs = &ck->ring[ck->head++ % CKSUM_RING];
+	cs->buf = buf;
+	cs->len = len;
+	cs->owned = owned;
+	cksem_post(control, &ck->ready);
 }
 
-static inline void hash_search(rzip_control *control, struct rzip_state *st,
-			       double pct_base, double pct_multiple)
+/* Wait for the worker to finish every slice handed to it */
+static void cksum_drain(rzip_control *control)
 {
-	i64 cksum_limit = 0, p, end, cksum_chunks, cksum_remains, i;
-	tag t = 0, tag_mask = (1 << st->level->initial_freq) - 1;
-	struct sliding_buffer *sb = &control->sb;
-	int lastpct = 0, last_chunkpct = 0;
-	struct {
-		i64 p;
-		i64 ofs;
-		i64 len;
-	} current;
+	int i;
 
-	if (st->hash_table)
-		memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1<<st->hash_bits));
-	else {
-		i64 hashsize = st->level->mb_used *
-				(ONE_MB / sizeof(st->hash_table[0]));
-		for (st->hash_bits = 0; (1U << st->hash_bits) < hashsize; st->hash_bits++);
+	for (i = 0; i < CKSUM_RING; i++)
+		cksem_wait(control, &control->checksum.room);
+	for (i = 0; i < CKSUM_RING; i++)
+		cksem_post(control, &control->checksum.room);
+}
 
-		print_maxverbose("hashsize = %'"PRId64".  bits = %'"PRId64". %'"PRIu32"MB\n",
-				 hashsize, st->hash_bits, st->level->mb_used);
+static void start_cksum_worker(rzip_control *control)
+{
+	struct checksum *ck = &control->checksum;
+	int i;
 
-		/* 66% full at max. */
-		st->hash_limit = (1 << st->hash_bits) / 3 * 2;
-		st->hash_table = calloc(sizeof(st->hash_table[0]), (1 << st->hash_bits));
-		if (unlikely(!st->hash_table))
-			fatal("Failed to allocate hash table in hash_search\n");
-	}
+	ck->head = ck->tail = 0;
+	cksem_init(control, &ck->ready);
+	cksem_init(control, &ck->room);
+	for (i = 0; i < CKSUM_RING; i++)
+		cksem_post(control, &ck->room);
+	create_pthread(control, &ck->thread, NULL, cksum_worker, control);
+}
 
-	st->minimum_tag_mask = tag_mask;
-	st->tag_clean_ptr = 0;
-	st->cksum = 0;
-	st->hash_count = 0;
+static void stop_cksum_worker(rzip_control *control)
+{
+	cksum_push(control, NULL, 0, false);
+	join_pthread(control, control->checksum.thread, NULL);
+}
 
-	p = 0;
-	end = st->chunk_size - MINIMUM_MATCH;
-	st->last_match = p;
-	current.len = 0;
-	current.p = p;
-	current.ofs = 0;
+/* Hand the next slice of the chunk to the checksum worker. A fully mapped
+ * chunk is passed as is, a sliding mmap one is copied first. Returns the
+ * new checksum limit. */
+static i64 cksum_slice(rzip_control *control, struct rzip_state *st, i64 cksum_limit)
+{
+	i64 len = MIN(st->chunk_size - cksum_limit, CKSUM_CHUNK);
+	uchar *buf;
 
-	if (likely(end > 0))
-		t = control->full_tag(control, st, p);
+	if (st->mmap_size >= st->chunk_size) {
+		cksum_push(control, control->sb.buf_low + cksum_limit, len, false);
+	} else {
+		buf = malloc(len);
+		if (unlikely(!buf))
+			fatal("Failed to malloc ckbuf in hash_search\n");
+		control->do_mcpy(control, buf, cksum_limit, len);
+		cksum_push(control, buf, len, true);
+	}
+	return cksum_limit + len;
+}
 
-	while (p < end) {
-		i64 reverse, mlen, offset;
+static void show_search_progress(rzip_control *control, struct rzip_state *st, i64 p, i64 end,
+				 double pct_base, double pct_multiple, int *lastpct, int *last_chunkpct)
+{
+	int pct, chunk_pct;
+
+	pct = pct_base + (pct_multiple * (100.0 * p) / st->chunk_size );
+	chunk_pct = p * 100 / end;
+	if (pct != *lastpct || chunk_pct != *last_chunkpct) {
+		if (!STDIN || st->stdin_eof)
+			print_progress("Total: %2d%%  ", pct);
+		print_progress("Chunk: %2d%%\r", chunk_pct);
+		/* lrzip library callback code removed */
+		*lastpct = pct;
+		*last_chunkpct = chunk_pct;
+	}
+}
 
-		sb->offset_search = ++p;
-		if (unlikely(sb->offset_search > sb->offset_low + sb->size_low))
-			remap_low_sb(control, &control->sb);
+/* How many bytes of hash table the search of this chunk should use */
+static i64 hash_table_size(rzip_control *control, struct rzip_state *st)
+{
+	i64 size = st->level->mb_used * ONE_MB, want;
 
-		if (unlikely(p % 128 == 0 && st->chunk_size)) {
-			i64 chunk_pct;
-			int pct;
-
-			pct = pct_base + (pct_multiple * (100.0 * p) / st->chunk_size );
-			chunk_pct = p * 100 / end;
-			if (pct != lastpct || chunk_pct != last_chunkpct) {
-				if (!STDIN || st->stdin_eof)
-					print_progress("Total: %2d%%  ", pct);
-				print_progress("Chunk: %2d%%\r", chunk_pct);
-				/* lrzip library callback code removed */
-				lastpct = pct;
-				last_chunkpct = chunk_pct;
-			}
-		}
+	/* One dedup index entry for every smallest piece */
+	if (st->level->cdc_bits) {
+		want = MIN(st->chunk_size / CDC_MIN_SIZE * (i64)sizeof(struct hash_entry),
+			   control->maxram >> st->level->ram_shift);
+		return MAX(size, want);
+	}
+	if (st->level->ram_shift) {
+		want = MIN(st->chunk_size / HASH_CHUNK_RATIO, control->maxram >> st->level->ram_shift);
+		size = MAX(size, want);
+	}
+	return size;
+}
 
-		control->next_tag(control, st, p, &t);
+static char hash_table_bits(i64 size)
+{
+	i64 hashsize = size / sizeof(struct hash_entry);
+	char bits;
 
-		/* Don't look for a match if there are no tags with
-		   this number of bits in the hash table. */
-		if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
-			continue;
+	for (bits = HASH_BUCKET_BITS; bits < HASH_MAX_BITS && (1LL << bits) < hashsize; bits++);
+	return bits;
+}
+
+/* Allocate a hash table of about size bytes. It is mapped so that each
+ * bucket is one cache line and large tables can be backed by huge pages. */
+static void alloc_hash_table(rzip_control *control, struct rzip_state *st, i64 size)
+{
+	i64 bytes;
+
+	st->hash_bits = hash_table_bits(size);
+	bytes = sizeof(st->hash_table[0]) << st->hash_bits;
+
+	/* 66% full at max. */
+	st->hash_limit = (1 << st->hash_bits) / 3 * 2;
+	st->hash_table = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (unlikely(st->hash_table == MAP_FAILED))
+		fatal("Failed to allocate hash table of %'"PRId64" bytes in alloc_hash_table\n", bytes);
+#ifdef MADV_HUGEPAGE
+	if (bytes >= 2 * ONE_MB)
+		madvise(st->hash_table, bytes, MADV_HUGEPAGE);
+#endif
+}
+
+static void free_hash_table(struct rzip_state *st)
+{
+	if (st->hash_table)
+		munmap(st->hash_table, sizeof(st->hash_table[0]) << st->hash_bits);
+	st->hash_table = NULL;
+}
+
+static void show_hash_fill(rzip_control *control, struct rzip_state *st, i64 bytes,
+			   i64 entries, i64 count, tag mask, i64 escalations)
+{
+	st->fill_bytes = bytes;
+	st->fill = (double)count / entries;
+	st->fill_mask = mask;
+	print_verbose("Hash table of %'"PRId64" MB: %.1f%% full, minimum tag mask %#x after %'"PRId64" escalations\n",
+		      bytes / ONE_MB, count * 100.0 / entries, (unsigned int)mask, escalations);
+}
+
+static void reset_hash_state(struct rzip_state *st, tag tag_mask)
+{
+	st->minimum_tag_mask = tag_mask;
+	st->tag_clean_ptr = 0;
+	st->hash_count = 0;
+	st->victim_round = 0;
+	st->last_match = 0;
+}
 
-		offset = 0;
-		mlen = find_best_match(control, st, t, p, end, &offset, &reverse);
+static inline void commit_match(rzip_control *control, struct rzip_state *st,
+				struct rzip_match *current)
+{
+	if (st->last_match < current->p)
+		put_literal(control, st, st->last_match, current->p);
+	put_match(control, st, current->p, current->ofs, current->len);
+	/* Each match is counted once, however many records encode it */
+	st->stats.matches++;
+	st->stats.match_bytes += current->len;
+	st->stats.len_hist[63 - __builtin_clzll(current->len)]++;
+	st->stats.dist_hist[63 - __builtin_clzll(current->p - current->ofs)]++;
+	st->last_match = current->p + current->len;
+	current->len = 0;
+}
+
+/* The length of the run of zero bytes from p up to end, or backwards from
+ * just before p down to end when rev is set, compared in place against
+ * zero_page with the match kernels */
+static i64 zero_run(rzip_control *control, struct rzip_state *st, i64 p, i64 end, bool rev)
+{
+	static const uchar zero_page[ZERO_PAGE];
+	i64 len = 0, max = rev ? p - end : end - p, n, m;
+	uchar *a;
+
+	while (len < max) {
+		m = MIN(MIN(chunk_run(control, st, rev ? p - len - 1 : p + len, rev, &a), max - len),
+			ZERO_PAGE);
+		n = rev ? rev_match(a + 1, zero_page + ZERO_PAGE, m) : fwd_match(a, zero_page, m);
+		len += n;
+		if (n < m)
+			break;
+	}
+	return len;
+}
+
+/* If p is in a run of at least ZERO_RUN_MIN zeros, encode the run as one
+ * literal zero and a match one byte back, and return true. Decompression
+ * writes such matches at once, or leaves holes in sparse output files. */
+static bool put_zero_run(rzip_control *control, struct rzip_state *st, i64 p, i64 end)
+{
+	struct rzip_match m;
+	i64 back, run;
+
+	if (zero_run(control, st, p, MIN(p + ZERO_PROBE, end), false) < ZERO_PROBE)
+		return false;
+	run = zero_run(control, st, p, end, false);
+	back = zero_run(control, st, p, MAX(0, st->last_match), true);
+	if (back + run < ZERO_RUN_MIN)
+		return false;
+	m.p = p - back + 1;
+	m.ofs = p - back;
+	m.len = back + run - 1;
+	commit_match(control, st, &m);
+	st->stats.zero_runs++;
+	return true;
+}
 
-		/* Only insert occasionally into hash. */
-		if ((t & tag_mask) == tag_mask) {
-			st->stats.inserts++;
-			st->hash_count++;
-			insert_hash(st, t, p);
-			if (st->hash_count > st->hash_limit)
-				tag_mask = clean_one_from_hash(control, st);
+/* Cut off the part of a candidate that overlaps data already encoded.
+ * Returns false if what remains is too short to be a match. */
+static inline bool trim_candidate(struct rzip_state *st, struct rzip_match *m)
+{
+	i64 overlap = st->last_match - m->p;
+
+	if (overlap > 0) {
+		if (m->len - overlap < MINIMUM_MATCH)
+			return false;
+		m->p += overlap;
+		m->ofs += overlap;
+		m->len -= overlap;
+	}
+	return true;
+}
+
+/* Add a candidate to the lazy window unless one already there covers it.
+ * Those it covers are dropped. */
+static void lazy_add(struct lazy_window *lw, struct rzip_match *m)
+{
+	i64 end = m->p + m->len;
+	int i, j;
+
+	for (i = j = 0; i < lw->n; i++) {
+		struct rzip_match *c = &lw->m[i];
+
+		if (c->p <= m->p && c->p + c->len >= end)
+			return;
+		if (c->p < m->p || c->p + c->len > end)
+			lw->m[j++] = *c;
+	}
+	for (i = j; i > 0 && lw->m[i - 1].p + lw->m[i - 1].len > end; i--)
+		lw->m[i] = lw->m[i - 1];
+	lw->m[i] = *m;
+	lw->n = j + 1;
+}
+
+static inline i64 lazy_start(struct lazy_window *lw)
+{
+	i64 start = lw->m[0].p;
+	int i;
+
+	for (i = 1; i < lw->n; i++)
+		start = MIN(start, lw->m[i].p);
+	return start;
+}
+
+/* Encode the chain of candidates in the lazy window that leaves the fewest
+ * literal bytes, counting the cost of each match header, instead of the
+ * longest one found first. A candidate may be cut at its start to follow
+ * the one before it. What is left of the others past the chain is kept. */
+static void lazy_commit(rzip_control *control, struct rzip_state *st,
+			struct lazy_window *lw)
+{
+	i64 best[LAZY_MAX], cost = 3 + st->chunk_bytes, start, v;
+	int prev[LAZY_MAX], chain[LAZY_MAX], top = 0, i, j, n;
+
+	/* Backends other than lzo find short matches among the literals
+	 * themselves, so a match has to replace more of them to pay off */
+	if (!NO_COMPRESS && !LZO_COMPRESS)
+		cost += MINIMUM_MATCH;
+
+	for (i = 0; i < lw->n; i++) {
+		best[i] = lw->m[i].len - cost;
+		prev[i] = -1;
+		for (j = 0; j < i; j++) {
+			if (lw->m[j].p + lw->m[j].len >= lw->m[i].p + lw->m[i].len)
+				continue;
+			start = MAX(lw->m[i].p, lw->m[j].p + lw->m[j].len);
+			if (lw->m[i].p + lw->m[i].len - start < MINIMUM_MATCH)
+				continue;
+			v = best[j] + lw->m[i].p + lw->m[i].len - start - cost;
+			if (v > best[i]) {
+				best[i] = v;
+				prev[i] = j;
+			}
 		}
+		if (best[i] > best[top])
+			top = i;
+	}
+
+	st->stats.lazy_windows++;
+	st->stats.lazy_candidates += lw->n;
+	/* Compared with encoding the longest candidate alone */
+	for (i = j = 0; i < lw->n; i++) {
+		if (lw->m[i].len > lw->m[j].len)
+			j = i;
+	}
+	st->stats.lazy_gain += best[top] - (lw->m[j].len - cost);
+
+	for (n = 0, i = top; i != -1; i = prev[i])
+		chain[n++] = i;
+	while (n--) {
+		struct rzip_match m = lw->m[chain[n]];
+
+		if (trim_candidate(st, &m))
+			commit_match(control, st, &m);
+	}
+
+	for (i = j = 0; i < lw->n; i++) {
+		struct rzip_match m = lw->m[i];
 
-		if (mlen > current.len) {
-			current.p = p - reverse;
-			current.len = mlen;
-			current.ofs = offset;
+		if (m.p + m.len > st->last_match && trim_candidate(st, &m))
+			lw->m[j++] = m;
+	}
+	lw->n = j;
+}
+
+/* Threads split the tag space between them using the high 32 bits of the
+ * tag. primary_hash() mixes these into the bucket too, but each thread has
+ * its own table and the multiply spreads one residue class of them as evenly
+ * as all tags, so no buckets are favoured. */
+static inline int tag_partition(tag t, int nthreads)
+{
+	return (int)(((uint64_t)t >> 32) % nthreads);
+}
+
+/* A reference file, such as the previous version of the input, is searched
+ * as if it came just before each chunk. Its index holds the tags of the
+ * positions with at least REF_INDEX_BITS low bits set, more if needed to
+ * keep it within a quarter of maxram, and the hash_index values they were
+ * computed with. The index is kept in a file next to the reference and
+ * rebuilt when the reference changes size or modification time. */
+#define REF_INDEX_MAGIC "LRZNREF1"
+#define REF_INDEX_BITS 6
+
+static char *ref_index_name(rzip_control *control)
+{
+	char *name = malloc(strlen(control->ref_name) + 8);
+
+	if (unlikely(!name))
+		fatal("Failed to allocate reference index name\n");
+	sprintf(name, "%s.lrzidx", control->ref_name);
+	return name;
+}
+
+static bool load_ref_index(rzip_control *control, struct rzip_state *st, struct stat *rs)
+{
+	char *name = ref_index_name(control), magic[8];
+	bool ret = false;
+	i64 hdr[3], i;
+	struct stat fs;
+	FILE *f;
+
+	f = fopen(name, "rb");
+	if (!f)
+		goto out;
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, REF_INDEX_MAGIC, sizeof(magic)) ||
+	    fread(hdr, sizeof(hdr), 1, f) != 1) {
+		print_verbose("Reference index %s is invalid\n", name);
+		goto out_close;
+	}
+	if ((i64)le64toh(hdr[0]) != rs->st_size || (i64)le64toh(hdr[1]) != rs->st_mtime) {
+		print_verbose("Reference index %s is out of date\n", name);
+		goto out_close;
+	}
+	control->ref_count = le64toh(hdr[2]);
+	/* The count must account for the whole file, past the magic, header
+	 * and hash_index */
+	if (unlikely(fstat(fileno(f), &fs) || control->ref_count < 0 ||
+		     control->ref_count > fs.st_size / (i64)sizeof(struct ref_entry) ||
+		     (i64)(sizeof(magic) + sizeof(hdr) + sizeof(st->hash_index)) +
+		     control->ref_count * (i64)sizeof(struct ref_entry) != fs.st_size)) {
+		print_verbose("Reference index %s is invalid\n", name);
+		control->ref_count = 0;
+		goto out_close;
+	}
+	control->ref_entries = malloc(sizeof(struct ref_entry) * MAX(control->ref_count, 1));
+	if (unlikely(!control->ref_entries))
+		fatal("Failed to allocate reference index of %'"PRId64" tags\n", control->ref_count);
+	if (fread(st->hash_index, sizeof(st->hash_index), 1, f) != 1 ||
+	    fread(control->ref_entries, sizeof(struct ref_entry), control->ref_count, f) != (size_t)control->ref_count) {
+		print_verbose("Reference index %s is truncated\n", name);
+		dealloc(control->ref_entries);
+		control->ref_count = 0;
+		goto out_close;
+	}
+	for (i = 0; i < 256; i++)
+		st->hash_index[i] = le64toh(st->hash_index[i]);
+	for (i = 0; i < control->ref_count; i++) {
+		control->ref_entries[i].t = le64toh(control->ref_entries[i].t);
+		control->ref_entries[i].pos = le64toh(control->ref_entries[i].pos);
+	}
+	print_verbose("Loaded reference index %s\n", name);
+	ret = true;
+out_close:
+	fclose(f);
+out:
+	dealloc(name);
+	return ret;
+}
+
+static void save_ref_index(rzip_control *control, struct rzip_state *st, struct stat *rs)
+{
+	char *name = ref_index_name(control);
+	tag hash_index[256];
+	struct ref_entry e;
+	bool err = false;
+	i64 hdr[3], i;
+	FILE *f;
+
+	f = fopen(name, "wb");
+	if (!f) {
+		print_verbose("Unable to save reference index %s\n", name);
+		dealloc(name);
+		return;
+	}
+	hdr[0] = htole64(rs->st_size);
+	hdr[1] = htole64(rs->st_mtime);
+	hdr[2] = htole64(control->ref_count);
+	for (i = 0; i < 256; i++)
+		hash_index[i] = htole64(st->hash_index[i]);
+	err = fwrite(REF_INDEX_MAGIC, 8, 1, f) != 1 || fwrite(hdr, sizeof(hdr), 1, f) != 1 ||
+		fwrite(hash_index, sizeof(hash_index), 1, f) != 1;
+	for (i = 0; i < control->ref_count && !err; i++) {
+		e.t = htole64(control->ref_entries[i].t);
+		e.pos = htole64(control->ref_entries[i].pos);
+		err = fwrite(&e, sizeof(e), 1, f) != 1;
+	}
+	if (fclose(f) || err) {
+		print_err("Failed to write reference index %s\n", name);
+		unlink(name);
+	} else
+		print_verbose("Saved reference index %s\n", name);
+	dealloc(name);
+}
+
+/* The fewest low bits set that keep an index of size bytes within a
+ * quarter of maxram */
+static int index_bits(rzip_control *control, i64 size)
+{
+	i64 max = control->maxram / 4 / sizeof(struct ref_entry);
+	int bits = REF_INDEX_BITS;
+
+	while ((size >> bits) > max)
+		bits++;
+	return bits;
+}
+
+/* Pass the tags of buf with at least bits low bits set to add */
+static void index_tags(rzip_control *control, struct rzip_state *st, uchar *buf, i64 size, int bits,
+		       void (*add)(rzip_control *, struct ref_entry *, void *), void *data)
+{
+	tag t = 0, mask = ((tag)1 << bits) - 1, last = 0;
+	struct ref_entry e;
+	i64 p;
+	int i;
+
+	for (i = 0; i < MINIMUM_MATCH; i++)
+		t ^= st->hash_index[buf[i]];
+	for (p = 0; ; p++) {
+		/* Runs of the same data give the same tag, keep one */
+		if ((t & mask) == mask && t != last) {
+			e.t = t;
+			e.pos = p;
+			add(control, &e, data);
+			last = t;
 		}
+		if (p + MINIMUM_MATCH >= size)
+			break;
+		t ^= st->hash_index[buf[p]] ^ st->hash_index[buf[p + MINIMUM_MATCH]];
+	}
+}
+
+static void add_ref_entry(rzip_control *control, struct ref_entry *e, void *data)
+{
+	i64 *alloced = data;
+
+	if (control->ref_count == *alloced) {
+		*alloced = *alloced ? *alloced * 2 : 65536;
+		control->ref_entries = realloc(control->ref_entries, sizeof(struct ref_entry) * *alloced);
+		if (unlikely(!control->ref_entries))
+			fatal("Failed to allocate reference index of %'"PRId64" tags\n", *alloced);
+	}
+	control->ref_entries[control->ref_count++] = *e;
+}
+
+static void build_ref_index(rzip_control *control, struct rzip_state *st)
+{
+	i64 alloced = 0;
+
+	index_tags(control, st, control->ref_buf, control->ref_size,
+		   index_bits(control, control->ref_size), add_ref_entry, &alloced);
+}
+
+/* Open the reference file and load or build its index. This has to come
+ * before the chunk size is set, since chunk and reference share the
+ * offsets a hash entry can hold. */
+static void init_reference(rzip_control *control, struct rzip_state *st)
+{
+	struct stat rs;
+
+	st->ref_base = HASH_MAX_OFFSET;
+	if (!control->ref_name)
+		return;
+
+	control->ref_fd = open(control->ref_name, O_RDONLY);
+	if (unlikely(control->ref_fd == -1))
+		fatal("Failed to open reference file %s\n", control->ref_name);
+	if (unlikely(fstat(control->ref_fd, &rs)))
+		fatal("Failed to stat reference file %s\n", control->ref_name);
+	if (unlikely(rs.st_size > HASH_MAX_OFFSET / 2))
+		fatal("Reference file %s is larger than %'"PRId64" bytes\n", control->ref_name, HASH_MAX_OFFSET / 2);
+	control->ref_size = rs.st_size;
+	if (control->ref_size < MINIMUM_MATCH) {
+		print_verbose("Reference file %s is too small to use\n", control->ref_name);
+		return;
+	}
+	st->ref_base = HASH_MAX_OFFSET - control->ref_size;
+	control->ref_buf = mmap(NULL, control->ref_size, PROT_READ, MAP_SHARED, control->ref_fd, 0);
+	if (unlikely(control->ref_buf == MAP_FAILED))
+		fatal("Failed to mmap reference file %s\n", control->ref_name);
+
+	if (!load_ref_index(control, st, &rs)) {
+		print_verbose("Indexing reference file %s\n", control->ref_name);
+		build_ref_index(control, st);
+		save_ref_index(control, st, &rs);
+	}
+	print_verbose("Reference file %s: %'"PRId64" bytes, %'"PRId64" tags indexed\n",
+		      control->ref_name, control->ref_size, control->ref_count);
+}
+
+static void close_reference(rzip_control *control)
+{
+	if (control->ref_buf)
+		munmap(control->ref_buf, control->ref_size);
+	if (control->ref_fd != -1)
+		close(control->ref_fd);
+	dealloc(control->ref_entries);
+	control->ref_buf = NULL;
+	control->ref_fd = -1;
+	control->ref_size = control->ref_count = 0;
+}
+
+/* In --global mode a first pass indexes the whole input the same way as a
+ * reference file, so that each chunk can also match the chunks before it as
+ * if they came after the reference file. The index goes to an unlinked
+ * temporary file that is mapped, so it only takes ram while it is used. */
+static void add_glob_entry(rzip_control *control, struct ref_entry *e, void *data)
+{
+	if (unlikely(fwrite(e, sizeof(*e), 1, (FILE *)data) != 1))
+		fatal("Failed to write global index\n");
+	control->glob_count++;
+}
+
+static void init_global(rzip_control *control, struct rzip_state *st, int fd_in)
+{
+	char *name;
+	int fd, bits;
+	FILE *f;
+
+	if (!GLOBAL_INDEX)
+		return;
+	if (STDIN) {
+		print_output("Cannot use --global with STDIN, ignoring\n");
+		control->flags &= ~FLAG_GLOBAL_INDEX;
+		return;
+	}
+	if (control->max_chunk >= control->st_size) {
+		print_verbose("File fits in one chunk, no global index needed\n");
+		control->flags &= ~FLAG_GLOBAL_INDEX;
+		return;
+	}
+	if (control->ref_size + control->st_size > HASH_MAX_OFFSET / 2) {
+		print_output("File is larger than %'"PRId64" bytes, ignoring --global\n",
+			     HASH_MAX_OFFSET / 2 - control->ref_size);
+		control->flags &= ~FLAG_GLOBAL_INDEX;
+		return;
+	}
 
-		if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH)
-		    && current.len >= MINIMUM_MATCH) {
-			if (st->last_match < current.p)
-				put_literal(control, st, st->last_match, current.p);
-			put_match(control, st, current.p, current.ofs, current.len);
-			st->last_match = current.p + current.len;
-			current.p = p = st->last_match;
-			current.len = 0;
-			t = control->full_tag(control, st, p);
+	control->glob_size = control->st_size;
+	st->ref_base = HASH_MAX_OFFSET - control->ref_size - control->glob_size;
+	control->glob_buf = mmap(NULL, control->glob_size, PROT_READ, MAP_SHARED, fd_in, 0);
+	if (unlikely(control->glob_buf == MAP_FAILED))
+		fatal("Failed to mmap %s for global index\n", control->infile);
+
+	name = malloc(strlen(control->tmpdir) + 16);
+	if (unlikely(!name))
+		fatal("Failed to allocate global index name\n");
+	sprintf(name, "%slrzipidx.XXXXXX", control->tmpdir);
+	fd = mkstemp(name);
+	if (unlikely(fd == -1))
+		fatal("Failed to create global index %s\n", name);
+	unlink(name);
+	dealloc(name);
+	f = fdopen(fd, "w+b");
+	if (unlikely(!f))
+		fatal("Failed to fdopen global index\n");
+
+	bits = index_bits(control, control->glob_size);
+	print_verbose("Indexing %s for global matches\n", control->infile);
+	madvise(control->glob_buf, control->glob_size, MADV_SEQUENTIAL);
+	index_tags(control, st, control->glob_buf, control->glob_size, bits, add_glob_entry, f);
+	madvise(control->glob_buf, control->glob_size, MADV_RANDOM);
+	if (unlikely(fflush(f)))
+		fatal("Failed to write global index\n");
+	if (control->glob_count) {
+		control->glob_entries = mmap(NULL, sizeof(struct ref_entry) * control->glob_count,
+					     PROT_READ, MAP_SHARED, fd, 0);
+		if (unlikely(control->glob_entries == MAP_FAILED))
+			fatal("Failed to mmap global index\n");
+	}
+	fclose(f);
+	print_verbose("Global index: %'"PRId64" tags with %d low bits set\n", control->glob_count, bits);
+}
+
+static void close_global(rzip_control *control)
+{
+	if (control->glob_entries)
+		munmap(control->glob_entries, sizeof(struct ref_entry) * control->glob_count);
+	if (control->glob_buf)
+		munmap(control->glob_buf, control->glob_size);
+	control->glob_entries = NULL;
+	control->glob_buf = NULL;
+	control->glob_size = control->glob_count = 0;
+}
+
+/* The global index entries of the chunks before this one */
+static i64 glob_entries_before(rzip_control *control, i64 limit)
+{
+	struct ref_entry *e = control->glob_entries;
+	i64 lo = 0, hi = control->glob_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (e[mid].pos + MINIMUM_MATCH <= limit)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void count_tags(struct ref_entry *e, i64 n, int nthreads, int id, i64 *count)
+{
+	i64 i;
+
+	for (i = 0; i < n; i++) {
+		if (nthreads == 1 || tag_partition(e[i].t, nthreads) == id)
+			count[MIN(tag_bitness(e[i].t), 63)]++;
+	}
+}
+
+static void insert_tags(struct rzip_state *st, struct ref_entry *e, i64 n, i64 base,
+			int bits, int nthreads, int id)
+{
+	i64 i;
+
+	for (i = 0; i < n; i++) {
+		if (nthreads > 1 && tag_partition(e[i].t, nthreads) != id)
+			continue;
+		if (tag_bitness(e[i].t) < (unsigned)bits)
+			continue;
+		st->hash_count++;
+		insert_hash(st, e[i].t, base + e[i].pos);
+	}
+}
+
+/* Put the indexed tags of the reference file, and of the chunks before this
+ * one in --global mode, into a fresh hash table. When they would fill more
+ * than half of it, only those with the most low bits set are used. Search
+ * threads take the tags of their own partition. */
+static void preload_reference(rzip_control *control, struct rzip_state *st, int nthreads, int id)
+{
+	i64 count[64] = { 0 }, room = st->hash_limit / 2, n = 0, glob_count = 0;
+	int bits;
+
+	if (control->glob_count)
+		glob_count = glob_entries_before(control, st->hist_size - control->ref_size);
+	if (!control->ref_count && !glob_count)
+		return;
+	count_tags(control->ref_entries, control->ref_count, nthreads, id, count);
+	count_tags(control->glob_entries, glob_count, nthreads, id, count);
+	for (bits = 64; bits > 0 && n + count[bits - 1] <= room; bits--)
+		n += count[bits - 1];
+
+	insert_tags(st, control->ref_entries, control->ref_count, st->ref_base, bits, nthreads, id);
+	insert_tags(st, control->glob_entries, glob_count, st->ref_base + control->ref_size,
+		    bits, nthreads, id);
+	print_maxverbose("Preloaded %'"PRId64" reference tags\n", n);
+}
+
+/* stdin is not file backed so we have to emulate the mmap by mapping
+ * anonymous ram and reading stdin into it. It means the maximum ram
+ * we can use will be less but we will already have determined this in
+ * rzip_chunk. The reading is done by a thread so the search can trail
+ * behind it instead of waiting for the whole chunk. */
+static void *stdin_reader(void *data)
+{
+	rzip_control *control = data;
+	struct stdin_reader *r = &control->reader;
+	i64 total = 0;
+	ssize_t ret;
+
+	while (total < r->size) {
+		ret = read(fileno(control->inFILE), r->buf + total, (size_t)MIN(r->size - total, STDIN_READ));
+		if (unlikely(ret < 0))
+			fatal("Failed to read in stdin_reader\n");
+		if (!ret) {
+			/* Should be EOF */
+			r->eof = true;
+			break;
+		}
+		total += ret;
+		lock_mutex(control, &r->lock);
+		r->filled = total;
+		pthread_cond_broadcast(&r->cond);
+		unlock_mutex(control, &r->lock);
+	}
+
+	lock_mutex(control, &r->lock);
+	if (r->eof)
+		control->eof = 1;
+	r->done = true;
+	if (r->ss)
+		set_stream_size(control, r->ss, total);
+	pthread_cond_broadcast(&r->cond);
+	unlock_mutex(control, &r->lock);
+
+	return NULL;
+}
+
+static void start_stdin_reader(rzip_control *control, struct rzip_state *st, uchar *buf)
+{
+	struct stdin_reader *r = &control->reader;
+
+	r->buf = buf;
+	r->size = st->chunk_size;
+	r->filled = 0;
+	r->done = r->eof = false;
+	r->ss = NULL;
+	init_mutex(control, &r->lock);
+	if (unlikely(pthread_cond_init(&r->cond, NULL)))
+		fatal("Failed to pthread_cond_init in start_stdin_reader\n");
+	if (unlikely(!create_pthread(control, &r->thread, NULL, stdin_reader, control)))
+		fatal("Failed to create stdin reader thread\n");
+}
+
+/* Hand the chunk's streams to the reader to size, or size them now if the
+ * reader has already finished */
+static void size_stdin_streams(rzip_control *control, void *ss)
+{
+	struct stdin_reader *r = &control->reader;
+
+	lock_mutex(control, &r->lock);
+	if (r->done)
+		set_stream_size(control, ss, r->filled);
+	else {
+		defer_stream_size(control, ss);
+		r->ss = ss;
+	}
+	unlock_mutex(control, &r->lock);
+}
+
+/* How far the search may go from p. It waits until there is STDIN_AHEAD of
+ * data past p and keeps a checksum slice clear of the data still arriving.
+ * Once the reader is done the chunk takes its real size. */
+static i64 stdin_search_end(rzip_control *control, struct rzip_state *st, i64 p)
+{
+	struct stdin_reader *r = &control->reader;
+	bool done;
+	i64 filled;
+
+	lock_mutex(control, &r->lock);
+	while (!r->done && r->filled < p + STDIN_AHEAD)
+		if (unlikely(pthread_cond_wait(&r->cond, &r->lock)))
+			fatal("Failed to pthread_cond_wait in stdin_search_end\n");
+	done = r->done;
+	filled = r->filled;
+	unlock_mutex(control, &r->lock);
+
+	if (!done)
+		return filled - CKSUM_CHUNK;
+	if (st->chunk_size != filled) {
+		print_maxverbose("Shrinking chunk to %'"PRId64"\n", filled);
+		st->chunk_size = filled;
+	}
+	return st->chunk_size - MINIMUM_MATCH;
+}
+
+static void stop_stdin_reader(rzip_control *control, struct rzip_state *st)
+{
+	struct stdin_reader *r = &control->reader;
+
+	join_pthread(control, r->thread, NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	if (r->eof)
+		st->stdin_eof = 1;
+	control->st_size += r->filled;
+}
+
+static i64 serial_hash_search(rzip_control *control, struct rzip_state *st,
+			      double pct_base, double pct_multiple)
+{
+	i64 cksum_limit = 0, p, end;
+	tag tag_mask = (1 << st->level->initial_freq) - 1;
+	struct sliding_buffer *sb = &control->sb;
+	int lastpct = 0, last_chunkpct = 0;
+	struct rzip_match current;
+	struct lazy_window lw;
+	struct tag_block *tb;
+	i64 hash_size, escalations;
+
+	hash_size = hash_table_size(control, st);
+	if (st->hash_table && st->hash_bits == hash_table_bits(hash_size))
+		memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1<<st->hash_bits));
+	else {
+		free_hash_table(st);
+		alloc_hash_table(control, st, hash_size);
+		print_maxverbose("hashsize = %'"PRId64".  bits = %'d. %'"PRId64"MB\n",
+				 (i64)1 << st->hash_bits, st->hash_bits,
+				 (sizeof(st->hash_table[0]) << st->hash_bits) / ONE_MB);
+	}
+	reset_hash_state(st, tag_mask);
+	preload_reference(control, st, 1, 0);
+	escalations = st->stats.mask_escalations;
+
+	p = 0;
+	if (STDIN)
+		end = stdin_search_end(control, st, p);
+	else
+		end = st->chunk_size - MINIMUM_MATCH;
+	current.len = 0;
+	current.p = p;
+	current.ofs = 0;
+	lw.n = 0;
+
+	tb = alloc_tag_block(control);
+
+	while (p < end) {
+		i64 block_end;
+		int i;
+
+		/* Commit what is pending before a run of zeros, then skip it */
+		if (unlikely(zero_run(control, st, p, MIN(p + ZERO_PROBE, end), false) == ZERO_PROBE)) {
+			if (st->level->lazy) {
+				while (lw.n)
+					lazy_commit(control, st, &lw);
+			} else if (current.len >= MINIMUM_MATCH)
+				commit_match(control, st, &current);
+			p = MAX(p, st->last_match);
+			if (p < end && put_zero_run(control, st, p, end))
+				current.p = p = st->last_match;
+			if (p >= end)
+				break;
 		}
+		block_end = MIN(p + TAG_BLOCK, end);
+
+		fill_tag_block(control, st, tb, p + 1, block_end - p);
+
+		for (i = 0; i < tb->ncand; i++) {
+			i64 reverse, mlen, offset;
+			tag t = tb->t[i];
+
+			prefetch_candidates(control, st, tb, i);
+
+			/* Skip the positions covered by the last match */
+			if (tb->pos[i] <= p)
+				continue;
+			p = tb->pos[i];
+
+			/* Don't look for a match if there are no tags with
+			   this number of bits in the hash table. The mask
+			   may have grown since the block was filled. */
+			if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
+				continue;
+
+			offset = 0;
+			mlen = find_best_match(control, st, t, p, end, &offset, &reverse);
 
-		if (p > cksum_limit) {
-			/* We lock the mutex here and unlock it in the
-			 * cksumthread. This lock protects all the data in
-			 * control->checksum.
-			 */
-			cksem_wait(control, &control->cksumsem);
-			control->checksum.len = MIN(st->chunk_size - p, control->page_size);
-			control->checksum.buf = malloc(control->checksum.len);
-			if (unlikely(!control->checksum.buf))
-				fatal("Failed to malloc ckbuf in hash_search\n");
-			control->do_mcpy(control, control->checksum.buf, cksum_limit, control->checksum.len);
-//			control->checksum.cksum = &st->cksum;
-			cksum_limit += control->checksum.len;
-			cksum_update(control);
+			/* Only insert occasionally into hash. */
+			if ((t & tag_mask) == tag_mask) {
+				st->stats.inserts++;
+				st->hash_count++;
+				insert_hash(st, t, p);
+				if (st->hash_count > st->hash_limit)
+					tag_mask = clean_one_from_hash(control, st);
+			}
+
+			if (st->level->lazy) {
+				if (mlen) {
+					current.p = p - reverse;
+					current.len = mlen;
+					current.ofs = offset;
+					lazy_add(&lw, &current);
+				}
+				/* Choose once the window is full, a great match is
+				 * found or the search is far enough past the start of
+				 * the window */
+				if (lw.n && (lw.n == (int)st->level->lazy || mlen >= GREAT_MATCH ||
+					     p >= lazy_start(&lw) + st->level->lazy * MINIMUM_MATCH / 2)) {
+					lazy_commit(control, st, &lw);
+					p = MAX(p, st->last_match);
+				}
+			} else {
+				if (mlen > current.len) {
+					current.p = p - reverse;
+					current.len = mlen;
+					current.ofs = offset;
+				}
+
+				if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH)
+				    && current.len >= MINIMUM_MATCH) {
+					commit_match(control, st, &current);
+					current.p = p = st->last_match;
+				}
+			}
+
+			if (p > cksum_limit)
+				cksum_limit = cksum_slice(control, st, cksum_limit);
 		}
+		p = MAX(p, block_end);
+
+		sb->offset_search = p;
+		if (unlikely(sb->offset_search > sb->offset_low + sb->size_low))
+			remap_low_sb(control, &control->sb);
+
+		/* Piped input still being read */
+		if (unlikely(end < st->chunk_size - MINIMUM_MATCH))
+			end = stdin_search_end(control, st, p);
+
+		if (likely(st->chunk_size))
+			show_search_progress(control, st, p, st->chunk_size - MINIMUM_MATCH,
+					     pct_base, pct_multiple, &lastpct, &last_chunkpct);
+
+		if (p > cksum_limit)
+			cksum_limit = cksum_slice(control, st, cksum_limit);
 	}
+	dealloc(tb);
+	while (lw.n)
+		lazy_commit(control, st, &lw);
 
 	if (MAX_VERBOSE)
 		show_distrib(control, st);
+	show_hash_fill(control, st, sizeof(st->hash_table[0]) << st->hash_bits, (i64)1 << st->hash_bits,
+		       st->hash_count, st->minimum_tag_mask, st->stats.mask_escalations - escalations);
 
-	if (st->last_match < st->chunk_size)
-		put_literal(control, st, st->last_match, st->chunk_size);
+	return cksum_limit;
+}
 
-	if (st->chunk_size > cksum_limit) {
-		i64 cksum_len = control->maxram;
-		void *buf;
+/* Where to cut the next content defined piece of buf, which is len bytes:
+ * after the first byte where the top bits of the gear hash selected by mask
+ * are all clear, or at len. */
+static i64 cdc_cut(const uchar *buf, i64 len, uint64_t mask)
+{
+	uint64_t h = 0;
+	i64 i;
 
-		while (42) {
-			round_to_page(&cksum_len);
-			buf = malloc(cksum_len);
-			if (buf) {
-				print_maxverbose("Malloced %'"PRId64" for checksum ckbuf\n", cksum_len);
-				break;
+	if (len <= CDC_MIN_SIZE)
+		return len;
+	for (i = CDC_MIN_SIZE - CDC_WINDOW; i < CDC_MIN_SIZE; i++)
+		h = (h << 1) + cdc_gear[buf[i]];
+	for (; i < len; i++) {
+		h = (h << 1) + cdc_gear[buf[i]];
+		if (!(h & mask))
+			return i + 1;
+	}
+	return len;
+}
+
+/* A 64 bit fingerprint of a piece, eight bytes at a time */
+static uint64_t cdc_fingerprint(const uchar *buf, i64 len)
+{
+	uint64_t h = len * HASH_MIX, v;
+	i64 i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, buf + i, 8);
+		h ^= v * 0x87C37B91114253D5ULL;
+		h = ((h << 31) | (h >> 33)) * HASH_MIX;
+	}
+	for (v = 0; i < len; i++)
+		v = (v << 8) | buf[i];
+	h ^= v * 0x87C37B91114253D5ULL;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* The bytes of the chunk from p up to p + len, in place when they are
+ * mapped together or else copied to tmp */
+static const uchar *cdc_bytes(rzip_control *control, struct rzip_state *st, i64 p, i64 len,
+			      uchar *tmp)
+{
+	uchar *a;
+
+	if (chunk_run(control, st, p, false, &a) >= len)
+		return a;
+	control->do_mcpy(control, tmp, p, len);
+	return tmp;
+}
+
+/* Look up the piece at p with fingerprint fp in the dedup index and return
+ * the longest match it leads to, or insert it if there is none. An entry is
+ * the offset of the piece and the top bits of its fingerprint, placed by the
+ * low bits. Matches are checked and extended both ways like any other. */
+static i64 dedup_match(rzip_control *control, struct rzip_state *st, uint64_t fp, i64 p,
+		       i64 end, struct rzip_match *m)
+{
+	i64 mask = ((i64)1 << st->hash_bits) - 1, h = fp & mask;
+	uint64_t key = fp & ~HASH_OFFSET_MASK;
+	struct hash_entry *he;
+
+	m->len = 0;
+	for (he = &st->hash_table[h]; !empty_hash(he); he = &st->hash_table[h = (h + 1) & mask]) {
+		i64 op = entry_offset(he), mlen, rev;
+
+		if ((he->v & ~HASH_OFFSET_MASK) != key)
+			continue;
+		mlen = control->match_len(control, st, p, op, end, &rev);
+		if (mlen) {
+			st->stats.tag_hits++;
+			if (mlen > m->len) {
+				m->p = p - rev;
+				m->ofs = op - rev;
+				m->len = mlen;
 			}
-			cksum_len = cksum_len / 3 * 2;
-			if (cksum_len < control->page_size)
-				fatal("Failed to malloc any ram for checksum ckbuf\n");
+		} else
+			st->stats.tag_misses++;
+	}
+	if (!m->len && st->hash_count < st->hash_limit) {
+		he->v = key | p;
+		st->hash_count++;
+		st->stats.inserts++;
+	}
+	return m->len;
+}
+
+/* The search of the dedup level. Instead of sampling tags, the chunk is cut
+ * into pieces by content so that repeated blocks are cut the same way
+ * wherever they are, and each piece is looked up by its fingerprint. */
+static i64 dedup_search(rzip_control *control, struct rzip_state *st,
+			double pct_base, double pct_multiple)
+{
+	uint64_t mask = ~0ULL << (64 - st->level->cdc_bits);
+	struct sliding_buffer *sb = &control->sb;
+	int lastpct = 0, last_chunkpct = 0;
+	i64 cksum_limit = 0, p, end, hash_size, hits = st->stats.tag_hits;
+	struct rzip_match m;
+	uchar *tmp;
+
+	hash_size = hash_table_size(control, st);
+	if (st->hash_table && st->hash_bits == hash_table_bits(hash_size))
+		memset(st->hash_table, 0, sizeof(st->hash_table[0]) * (1<<st->hash_bits));
+	else {
+		free_hash_table(st);
+		alloc_hash_table(control, st, hash_size);
+	}
+	reset_hash_state(st, 0);
+	tmp = malloc(CDC_MAX_SIZE);
+	if (unlikely(!tmp))
+		fatal("Failed to allocate piece buffer in dedup_search\n");
+
+	p = 0;
+	if (STDIN)
+		end = stdin_search_end(control, st, p);
+	else
+		end = st->chunk_size - MINIMUM_MATCH;
+
+	while (p < end) {
+		i64 len = MIN(CDC_MAX_SIZE, end - p);
+		const uchar *buf;
+
+		if (put_zero_run(control, st, p, end)) {
+			p = st->last_match;
+		} else {
+			buf = cdc_bytes(control, st, p, len, tmp);
+			len = cdc_cut(buf, len, mask);
+			if (len >= MINIMUM_MATCH &&
+			    dedup_match(control, st, cdc_fingerprint(buf, len), p, end, &m)) {
+				commit_match(control, st, &m);
+				p = MAX(p + 1, st->last_match);
+			} else
+				p += len;
 		}
 
-		/* Compute checksum. If the entire chunk is longer than maxram,
-		 * do it "per-partes" */
-		cksem_wait(control, &control->cksumsem);
-		control->checksum.buf = buf;
-		control->checksum.len = st->chunk_size - cksum_limit;
-		cksum_chunks = control->checksum.len / cksum_len;
-		cksum_remains = control->checksum.len % cksum_len;
-
-		for (i = 0; i < cksum_chunks; i++) {
-			control->do_mcpy(control, control->checksum.buf, cksum_limit, cksum_len);
-			cksum_limit += cksum_len;
-//			st->cksum = CrcUpdate(st->cksum, control->checksum.buf, cksum_len);
-			gcry_md_write(control->crc_handle, control->checksum.buf, cksum_len);
-			if (HAS_HASH)
-				gcry_md_write(control->hash_handle, control->checksum.buf, cksum_len);
+		sb->offset_search = p;
+		if (unlikely(sb->offset_search > sb->offset_low + sb->size_low))
+			remap_low_sb(control, &control->sb);
+
+		/* Piped input still being read */
+		if (unlikely(end < st->chunk_size - MINIMUM_MATCH))
+			end = stdin_search_end(control, st, p);
+
+		if (likely(st->chunk_size))
+			show_search_progress(control, st, p, st->chunk_size - MINIMUM_MATCH,
+					     pct_base, pct_multiple, &lastpct, &last_chunkpct);
+
+		if (p > cksum_limit)
+			cksum_limit = cksum_slice(control, st, cksum_limit);
+	}
+	dealloc(tmp);
+
+	print_maxverbose("Dedup index: %'"PRId64" pieces, %'"PRId64" duplicates found\n",
+			 st->hash_count, st->stats.tag_hits - hits);
+	show_hash_fill(control, st, sizeof(st->hash_table[0]) << st->hash_bits, (i64)1 << st->hash_bits,
+		       st->hash_count, 0, 0);
+
+	return cksum_limit;
+}
+
+/* Remember fp in a sampling table and return whether it was there */
+struct sample_table {
+	uint64_t *fp;
+	uint64_t mask;
+	i64 used;
+	i64 limit;	/* only looked up once 2/3 full, as the hash table */
+};
+
+/* A table with room for entries fingerprints at half load */
+static void alloc_sample_table(rzip_control *control, struct sample_table *t, i64 entries)
+{
+	int bits = 10;
+
+	while (bits < AUTO_TABLE_BITS && ((i64)1 << bits) < entries * 2)
+		bits++;
+	t->fp = calloc((size_t)1 << bits, sizeof(uint64_t));
+	if (unlikely(!t->fp))
+		fatal("Failed to allocate sampling tables in choose_level\n");
+	t->mask = ((uint64_t)1 << bits) - 1;
+	t->used = 0;
+	t->limit = ((i64)1 << bits) / 3 * 2;
+}
+
+static bool sample_seen(struct sample_table *t, uint64_t fp)
+{
+	uint64_t h = fp & t->mask;
+
+	fp |= 1;
+	for (; t->fp[h]; h = (h + 1) & t->mask)
+		if (t->fp[h] == fp)
+			return true;
+	if (t->used < t->limit) {
+		t->fp[h] = fp;
+		t->used++;
+	}
+	return false;
+}
+
+/* Choose the level of this chunk for -R auto from how redundant its start
+ * is: the share of probes of MINIMUM_MATCH bytes seen before, and of bytes in
+ * pieces seen before. Unique data gets a small table and short chains, and
+ * the more repeats there are the higher the level. */
+static void choose_level(rzip_control *control, struct rzip_state *st)
+{
+	uint64_t probe_mask = ~0ULL << (64 - AUTO_PROBE_BITS), piece_mask = ~0ULL << (64 - AUTO_PIECE_BITS);
+	i64 sample, p, probes = 0, probe_hits = 0, piece_hits = 0;
+	struct sample_table probe_table, piece_table;
+	double redundancy;
+	uchar *tmp;
+	int level;
+
+	sample = MIN(MAX(st->chunk_size >> AUTO_SAMPLE_SHIFT, AUTO_SAMPLE_MIN), AUTO_SAMPLE_MAX);
+	if (STDIN)
+		sample = MIN(sample, stdin_search_end(control, st, sample));
+	sample = MIN(sample, st->chunk_size);
+
+	alloc_sample_table(control, &probe_table, sample >> AUTO_PROBE_BITS);
+	alloc_sample_table(control, &piece_table, sample >> AUTO_PIECE_BITS);
+	tmp = malloc(CDC_MAX_SIZE);
+	if (unlikely(!tmp))
+		fatal("Failed to allocate sampling tables in choose_level\n");
+
+	for (p = 0; p < sample; ) {
+		i64 len = MIN(CDC_MAX_SIZE, sample - p), i;
+		const uchar *buf = cdc_bytes(control, st, p, len, tmp);
+		uint64_t h = 0;
+
+		len = cdc_cut(buf, len, piece_mask);
+		/* Probe the MINIMUM_MATCH bytes up to each anchor in the piece */
+		for (i = 0; i < len; i++) {
+			h = (h << 1) + cdc_gear[buf[i]];
+			if (!(h & probe_mask) && i >= MINIMUM_MATCH) {
+				probes++;
+				probe_hits += sample_seen(&probe_table, cdc_fingerprint(buf + i - MINIMUM_MATCH, MINIMUM_MATCH));
+			}
 		}
-		/* Process end of the checksum buffer */
-		control->do_mcpy(control, control->checksum.buf, cksum_limit, cksum_remains);
-//		st->cksum = CrcUpdate(st->cksum, control->checksum.buf, cksum_remains);
-		gcry_md_write(control->crc_handle, control->checksum.buf, cksum_remains);
-		if (HAS_HASH)
-			gcry_md_write(control->hash_handle, control->checksum.buf, cksum_remains);
-		dealloc(control->checksum.buf);
-		cksem_post(control, &control->cksumsem);
-	} else {
-		cksem_wait(control, &control->cksumsem);
-		cksem_post(control, &control->cksumsem);
+		if (sample_seen(&piece_table, cdc_fingerprint(buf, len)))
+			piece_hits += len;
+		p += len;
 	}
+	dealloc(probe_table.fp);
+	dealloc(piece_table.fp);
+	dealloc(tmp);
+
+	redundancy = MAX(probes ? (double)probe_hits / probes : 0, sample ? (double)piece_hits / sample : 0);
+	if (redundancy < 0.02)
+		level = 5;
+	else if (redundancy < 0.10)
+		level = 7;
+	else if (redundancy < 0.25)
+		level = 8;
+	else
+		level = 9;
+	st->level = &levels[level];
+	print_verbose("Sampled %'"PRId64" bytes: %.1f%% probes and %.1f%% pieces repeated, rzip level %d\n",
+		      sample, probes ? probe_hits * 100.0 / probes : 0.0,
+		      sample ? piece_hits * 100.0 / sample : 0.0, level);
+}
+
+static void add_candidate(rzip_control *control, struct search_thread *sth, int slot,
+			  struct rzip_match *m)
+{
+	if (sth->ncand[slot] == sth->maxcand[slot]) {
+		sth->maxcand[slot] = sth->maxcand[slot] ? sth->maxcand[slot] * 2 : 1024;
+		sth->cand[slot] = realloc(sth->cand[slot], sizeof(struct rzip_match) * sth->maxcand[slot]);
+		if (unlikely(!sth->cand[slot]))
+			fatal("Failed to realloc match candidates in add_candidate\n");
+	}
+	sth->cand[slot][sth->ncand[slot]++] = *m;
+}
+
+/* Each search thread scans the rounds of the chunk given to it by the main
+ * thread, but only looks up and inserts the tags of its own partition into
+ * its private hash table. Matches are selected exactly as in the serial
+ * search and queued as candidates for the main thread to merge. Runs of
+ * zeros are queued as candidates with ofs == p for it to encode. */
+static void *search_thread(void *data)
+{
+	struct search_thread *sth = (struct search_thread *)data;
+	struct search_pool *pool = sth->pool;
+	rzip_control *control = pool->control;
+	struct rzip_state *st = &sth->st;
+	struct tag_block *tb = alloc_tag_block(control);
+	tag tag_mask = sth->tag_mask;
+	i64 p = 0, end = pool->end;
+	struct rzip_match current, zero;
+	bool last;
+
+	current.len = 0;
+	current.p = p;
+	current.ofs = 0;
+
+	do {
+		i64 limit;
+		int slot;
+
+		cksem_wait(control, &sth->start);
+		slot = pool->round & 1;
+		limit = MIN(pool->round_end, end);
+		last = pool->round_end >= end;
+		sth->ncand[slot] = 0;
+
+		while (p < limit) {
+			i64 block_end;
+			int i;
+
+			/* Queue what is pending before a run of zeros, then the
+			 * run, and skip it */
+			if (unlikely(zero_run(control, st, p, MIN(p + ZERO_PROBE, end), false) == ZERO_PROBE)) {
+				if (current.len >= MINIMUM_MATCH) {
+					add_candidate(control, sth, slot, &current);
+					st->last_match = current.p + current.len;
+				}
+				p = MAX(p, st->last_match);
+				zero.p = zero.ofs = p;
+				zero.len = zero_run(control, st, p, end, false);
+				if (zero.len >= ZERO_PROBE) {
+					add_candidate(control, sth, slot, &zero);
+					st->last_match = p + zero.len;
+				}
+				current.p = p = MAX(p, st->last_match);
+				current.len = 0;
+				if (p >= limit)
+					continue;
+			}
+			block_end = MIN(p + TAG_BLOCK, limit);
+
+			fill_tag_block(control, st, tb, p + 1, block_end - p);
+
+			for (i = 0; i < tb->ncand; i++) {
+				i64 reverse, mlen, offset;
+				tag t = tb->t[i];
+
+				prefetch_candidates(control, st, tb, i);
+				if (tb->pos[i] <= p)
+					continue;
+				p = tb->pos[i];
+				if (tag_partition(t, pool->nthreads) != sth->id)
+					continue;
+				if ((t & st->minimum_tag_mask) != st->minimum_tag_mask)
+					continue;
+
+				offset = 0;
+				mlen = find_best_match(control, st, t, p, end, &offset, &reverse);
+
+				if ((t & tag_mask) == tag_mask) {
+					st->stats.inserts++;
+					st->hash_count++;
+					insert_hash(st, t, p);
+					if (st->hash_count > st->hash_limit)
+						tag_mask = clean_one_from_hash(control, st);
+				}
+
+				if (mlen > current.len) {
+					current.p = p - reverse;
+					current.len = mlen;
+					current.ofs = offset;
+				}
+
+				if ((current.len >= GREAT_MATCH || p >= current.p + MINIMUM_MATCH)
+				    && current.len >= MINIMUM_MATCH) {
+					add_candidate(control, sth, slot, &current);
+					st->last_match = current.p + current.len;
+					current.p = p = st->last_match;
+					current.len = 0;
+				}
+			}
+			p = MAX(p, block_end);
+		}
+		if (last && current.len >= MINIMUM_MATCH)
+			add_candidate(control, sth, slot, &current);
+		cksem_post(control, &pool->done);
+	} while (!last);
+
+	dealloc(tb);
+	return NULL;
+}
+
+/* Merge the candidates of one round from all threads in order of position,
+ * applying the same selection rules as the serial search. current carries
+ * the pending match over to the next round. A run of zeros commits what is
+ * pending and is encoded as the serial search does, once. */
+static void merge_candidates(rzip_control *control, struct rzip_state *st,
+			     struct search_pool *pool, int slot, i64 *next,
+			     struct rzip_match *current)
+{
+	int i;
+
+	for (i = 0; i < pool->nthreads; i++)
+		next[i] = 0;
+
+	while (42) {
+		struct search_thread *best = NULL;
+		struct rzip_match m;
+
+		for (i = 0; i < pool->nthreads; i++) {
+			struct search_thread *sth = &pool->sths[i];
+
+			if (next[i] == sth->ncand[slot])
+				continue;
+			if (!best || sth->cand[slot][next[i]].p < best->cand[slot][next[best->id]].p)
+				best = sth;
+		}
+		if (!best)
+			break;
+		m = best->cand[slot][next[best->id]++];
+
+		if (m.ofs == m.p) {
+			i64 p;
+
+			if (current->len >= MINIMUM_MATCH)
+				commit_match(control, st, current);
+			current->len = 0;
+			p = MAX(m.p, st->last_match);
+			if (p < m.p + m.len)
+				put_zero_run(control, st, p, pool->end);
+			continue;
+		}
+		if (current->len && (current->len >= GREAT_MATCH || m.p >= current->p + MINIMUM_MATCH))
+			commit_match(control, st, current);
+		if (!trim_candidate(st, &m))
+			continue;
+		if (m.len > current->len)
+			*current = m;
+	}
+}
+
+/* Search a chunk with several threads. The chunk is handed out in rounds;
+ * the checksum worker hashes a round while it is searched and the main
+ * thread merges the candidates of each round while the threads search the
+ * next one. */
+static i64 parallel_hash_search(rzip_control *control, struct rzip_state *st, int nthreads,
+				double pct_base, double pct_multiple)
+{
+	i64 end = st->chunk_size - MINIMUM_MATCH, round_start = 0, cksum_limit = 0, *next;
+	i64 hash_size = hash_table_size(control, st) / nthreads, entries = 0, count = 0, escalations = 0;
+	tag tag_mask = (1 << st->level->initial_freq) - 1, mask = 0;
+	int lastpct = 0, last_chunkpct = 0, i;
+	struct search_pool pool;
+	struct rzip_match current;
+	bool last;
+
+	pool.control = control;
+	pool.nthreads = nthreads;
+	pool.end = end;
+	pool.round = 0;
+	pool.round_end = MIN(SEARCH_ROUND, end);
+	pool.sths = calloc(sizeof(struct search_thread), nthreads);
+	next = calloc(sizeof(i64), nthreads);
+	if (unlikely(!pool.sths || !next))
+		fatal("Failed to calloc search threads in parallel_hash_search\n");
+	cksem_init(control, &pool.done);
+
+	print_maxverbose("Searching with %'d threads, hash table of %'"PRId64" bytes each\n",
+			 nthreads, hash_size);
+
+	for (i = 0; i < nthreads; i++) {
+		struct search_thread *sth = &pool.sths[i];
+
+		memcpy(&sth->st, st, sizeof(*st));
+		memset(&sth->st.stats, 0, sizeof(sth->st.stats));
+		alloc_hash_table(control, &sth->st, hash_size);
+		reset_hash_state(&sth->st, tag_mask);
+		preload_reference(control, &sth->st, nthreads, i);
+		sth->pool = &pool;
+		sth->id = i;
+		sth->tag_mask = tag_mask;
+		cksem_init(control, &sth->start);
+		create_pthread(control, &sth->pthread, NULL, search_thread, sth);
+		cksem_post(control, &sth->start);
+	}
+
+	current.len = 0;
+	current.p = 0;
+	current.ofs = 0;
+
+	do {
+		i64 round_end = pool.round_end;
+		int slot = pool.round & 1;
+
+		last = round_end >= end;
+		cksum_limit = last ? st->chunk_size : round_end;
+		cksum_push(control, control->sb.buf_low + round_start, cksum_limit - round_start, false);
+
+		for (i = 0; i < nthreads; i++)
+			cksem_wait(control, &pool.done);
+		if (!last) {
+			pool.round++;
+			pool.round_end = MIN(round_end + SEARCH_ROUND, end);
+			for (i = 0; i < nthreads; i++)
+				cksem_post(control, &pool.sths[i].start);
+		}
+
+		merge_candidates(control, st, &pool, slot, next, &current);
+		control->sb.offset_search = round_start = round_end;
+		show_search_progress(control, st, round_end, end, pct_base, pct_multiple,
+				     &lastpct, &last_chunkpct);
+	} while (!last);
+
+	if (current.len >= MINIMUM_MATCH)
+		commit_match(control, st, &current);
+
+	for (i = 0; i < nthreads; i++) {
+		struct search_thread *sth = &pool.sths[i];
+
+		join_pthread(control, sth->pthread, NULL);
+		st->stats.inserts += sth->st.stats.inserts;
+		st->stats.tag_hits += sth->st.stats.tag_hits;
+		st->stats.tag_misses += sth->st.stats.tag_misses;
+		st->stats.mask_escalations += sth->st.stats.mask_escalations;
+		escalations += sth->st.stats.mask_escalations;
+		entries += (i64)1 << sth->st.hash_bits;
+		count += sth->st.hash_count;
+		mask = MAX(mask, sth->st.minimum_tag_mask);
+		if (MAX_VERBOSE)
+			show_distrib(control, &sth->st);
+		free_hash_table(&sth->st);
+		dealloc(sth->cand[0]);
+		dealloc(sth->cand[1]);
+	}
+	dealloc(next);
+	dealloc(pool.sths);
+	show_hash_fill(control, st, entries * sizeof(struct hash_entry), entries, count, mask, escalations);
+
+	return cksum_limit;
+}
+
+/* The search threads need the whole chunk mapped so they are not used in
+ * sliding mmap mode, nor for chunks too small to be worth splitting. */
+static int search_threads(rzip_control *control, struct rzip_state *st)
+{
+	if (control->rzip_threads < 2)
+		return 1;
+	if (st->mmap_size < st->chunk_size) {
+		print_maxverbose("Sliding mmap in use, rzip search will be single threaded\n");
+		return 1;
+	}
+	if (st->chunk_size < SEARCH_ROUND * 2)
+		return 1;
+	return control->rzip_threads;
+}
+
+static inline void hash_search(rzip_control *control, struct rzip_state *st,
+			       double pct_base, double pct_multiple)
+{
+	struct timeval search_start, search_end;
+	double search_time;
+	i64 cksum_limit;
+	int nthreads;
+
+	st->cksum = 0;
+	st->last_match = 0;
+
+	gettimeofday(&search_start, NULL);
+	if (control->rzip_auto)
+		choose_level(control, st);
+	/* The search threads need the whole of piped input read */
+	if (STDIN && control->rzip_threads > 1)
+		stdin_search_end(control, st, st->chunk_size);
+	if (st->level->cdc_bits)
+		cksum_limit = dedup_search(control, st, pct_base, pct_multiple);
+	else if ((nthreads = search_threads(control, st)) > 1)
+		cksum_limit = parallel_hash_search(control, st, nthreads, pct_base, pct_multiple);
+	else
+		cksum_limit = serial_hash_search(control, st, pct_base, pct_multiple);
+	gettimeofday(&search_end, NULL);
+	search_time = (search_end.tv_sec - search_start.tv_sec) +
+		(search_end.tv_usec - search_start.tv_usec) / 1000000.0;
+	if (search_time > 0)
+		print_maxverbose("Searched %'"PRId64" positions in %.3fs, %'.0f positions/s\n",
+				 st->chunk_size, search_time, st->chunk_size / search_time);
+	st->stats.search_time += search_time;
+	st->stats.chunks++;
+	st->stats.bytes += st->chunk_size;
+
+	if (st->last_match < st->chunk_size)
+		put_literal(control, st, st->last_match, st->chunk_size);
+
+	while (cksum_limit < st->chunk_size)
+		cksum_limit = cksum_slice(control, st, cksum_limit);
+	cksum_drain(control);
 	memcpy(&st->cksum, gcry_md_read(control->crc_handle, *control->crc_gcode), *control->crc_len);
 
 	put_literal(control, st, 0, 0);
@@ -770,69 +2676,70 @@ static inline void init_hash_indexes(struct rzip_state *st)
 		st->hash_index[i] = ((random() << 16) ^ random());
 }
 
-#if !defined(__linux)
-# define mremap fake_mremap
-
-static inline void *fake_mremap(void *old_address, size_t old_size, size_t new_size, int flags __UNUSED__)
+static void *prefetch_thread(void *data)
 {
-	if (new_size > old_size) {	/* revert code and don't use fatal() */
-		fprintf(stderr, "fake_mremap: This should only be used to shrink things. I'm not bothering with this.\n");
-		exit(1);
-	} else {
-		/* new_size occupies N pages; old_size occupies M > N pages;
-		 we want to unmap the M - N pages at the end.
-		 note the idiom: ceiling(n/k) = (n+k-1) div k */
-		size_t kept_n = (new_size + PAGE_SIZE - 1) / PAGE_SIZE;
-		int ret = munmap(old_address + (kept_n * PAGE_SIZE), old_size - (kept_n * PAGE_SIZE));
-
-		if (ret < 0)
-			return MAP_FAILED;
+	rzip_control *control = data;
+	struct chunk_prefetch *pf = &control->prefetch;
+	volatile uchar touch;
+	i64 i;
 
-		return old_address;
+	pf->buf = (uchar *)mmap(NULL, pf->size, PROT_READ, MAP_SHARED, pf->fd, pf->offset);
+	if (pf->buf == MAP_FAILED) {
+		pf->buf = NULL;
+		return NULL;
 	}
+	madvise(pf->buf, pf->size, MADV_WILLNEED);
+	/* Fault each page in so the search finds it mapped */
+	for (i = 0; i < pf->size; i += control->page_size)
+		touch = pf->buf[i];
+	(void)touch;
+	return NULL;
 }
-#endif
 
-/* stdin is not file backed so we have to emulate the mmap by mapping
- * anonymous ram and reading stdin into it. It means the maximum ram
- * we can use will be less but we will already have determined this in
- * rzip_chunk */
-static inline void mmap_stdin(rzip_control *control, uchar *buf,
-			      struct rzip_state *st)
+/* Map and read in the next chunk while this one is searched and the back
+ * ends compress it, if there is room for it next to the window, the hash
+ * tables and the back end buffers. Otherwise only read ahead what fits. */
+static void start_prefetch(rzip_control *control, struct rzip_state *st, int fd_in,
+			   i64 offset, i64 len)
 {
-	i64 len = st->chunk_size;
-	uchar *offset_buf = buf;
-	ssize_t ret;
-	i64 total;
-
-	total = 0;
-	while (len > 0) {
-		ret = MIN(len, one_g);
-		ret = read(fileno(control->inFILE), offset_buf, (size_t)ret);
-		if (unlikely(ret < 0))
-			fatal("Failed to read in mmap_stdin\n");
-		total += ret;
-		if (ret == 0) {
-			/* Should be EOF */
-			print_maxverbose("Shrinking chunk to %'"PRId64"\n", total);
-			if (likely(total)) {
-				buf = (uchar *)mremap(buf, st->chunk_size, total, 0);
-				st->mmap_size = st->chunk_size = total;
-			} else {
-				/* Empty file */
-				buf = (uchar *)mremap(buf, st->chunk_size, control->page_size, 0);
-				st->mmap_size = control->page_size;
-				st->chunk_size = 0;
-			}
-			if (unlikely(buf == MAP_FAILED))
-				fatal("Failed to remap to smaller buf in mmap_stdin\n");
-			control->eof = st->stdin_eof = 1;
-			break;
+	struct chunk_prefetch *pf = &control->prefetch;
+	i64 size, room;
+
+	if (STDIN || GLOBAL_INDEX || len <= st->chunk_size)
+		return;
+	size = MIN(control->max_mmap, len - st->chunk_size);
+	room = control->ramsize - control->maxram - control->usable_ram -
+		hash_table_size(control, st) * control->rzip_threads;
+	if (size > room) {
+		if (room > 0) {
+			print_maxverbose("Reading ahead %'"PRId64" bytes of the next chunk\n", room);
+			posix_fadvise(fd_in, offset + st->chunk_size, room, POSIX_FADV_WILLNEED);
 		}
-		offset_buf += ret;
-		len -= ret;
+		return;
 	}
-	control->st_size += total;
+	print_maxverbose("Prefetching the next chunk of %'"PRId64" bytes\n", size);
+	pf->fd = fd_in;
+	pf->offset = offset + st->chunk_size;
+	pf->size = size;
+	pf->buf = NULL;
+	create_pthread(control, &pf->thread, NULL, prefetch_thread, control);
+	pf->active = true;
+}
+
+/* The mapping of the chunk at offset if the prefetch thread made it */
+static uchar *take_prefetch(rzip_control *control, i64 offset, i64 size)
+{
+	struct chunk_prefetch *pf = &control->prefetch;
+
+	if (!pf->active)
+		return NULL;
+	join_pthread(control, pf->thread, NULL);
+	pf->active = false;
+	if (pf->buf && (pf->offset != offset || pf->size != size)) {
+		munmap(pf->buf, pf->size);
+		pf->buf = NULL;
+	}
+	return pf->buf;
 }
 
 static inline void
@@ -841,14 +2748,15 @@ init_sliding_mmap(rzip_control *control, struct rzip_state *st, int fd_in,
 {
 	struct sliding_buffer *sb = &control->sb;
 
-	/* Initialise the high buffer. One page size is fastest to manipulate */
+	/* The high windows are mapped on demand. They are large enough that
+	 * matches rarely cross them, but small enough to be cheap to remap. */
 	if (!STDIN) {
-		sb->high_length = control->page_size;
-		sb->buf_high = (uchar *)mmap(NULL, sb->high_length, PROT_READ, MAP_SHARED, fd_in, offset);
-		if (unlikely(sb->buf_high == MAP_FAILED))
-			fatal("Unable to mmap buf_high in init_sliding_mmap\n");
-		sb->size_high = sb->high_length;
-		sb->offset_high = 0;
+		sb->high_length = st->mmap_size / (SB_WINDOWS * 4);
+		sb->high_length = MAX(ONE_MB, MIN(sb->high_length, 64 * ONE_MB));
+		round_to_page(&sb->high_length);
+		memset(sb->high, 0, sizeof(sb->high));
+		sb->last_high = NULL;
+		sb->use_count = sb->high_hits = sb->high_misses = sb->readaheads = 0;
 	}
 	sb->offset_low = 0;
 	sb->offset_search = 0;
@@ -868,6 +2776,106 @@ static void add_to_sslist(rzip_control *control, struct rzip_state *st)
 	st->head = node;
 }
 
+/* --stats-json writes one object per input file to the array main opened,
+ * with an entry for each chunk and the totals. Histograms are trimmed after
+ * the last non-empty bucket. */
+static void stats_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if ((uchar)*str < 0x20)
+			fprintf(f, "\\u%04x", (uchar)*str);
+		else
+			fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+static void stats_json_hist(FILE *f, const char *name, const i64 *now, const i64 *then)
+{
+	int i, last = -1;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if (now[i] - then[i])
+			last = i;
+	fprintf(f, ",\n\t\t\"%s\": [", name);
+	for (i = 0; i <= last; i++)
+		fprintf(f, "%s%"PRId64, i ? ", " : "", now[i] - then[i]);
+	fputc(']', f);
+}
+
+/* The counters of now less those of then, so both a chunk and the totals
+ * can be written */
+static void stats_json_counts(FILE *f, const struct rzip_stats *now, const struct rzip_stats *then)
+{
+	fprintf(f, "\t\t\"bytes\": %"PRId64",\n", now->bytes - then->bytes);
+	fprintf(f, "\t\t\"search_seconds\": %.6f,\n", now->search_time - then->search_time);
+	fprintf(f, "\t\t\"matches\": %"PRId64", \"match_bytes\": %"PRId64",\n",
+		now->matches - then->matches, now->match_bytes - then->match_bytes);
+	fprintf(f, "\t\t\"literals\": %"PRId64", \"literal_bytes\": %"PRId64",\n",
+		now->literals - then->literals, now->literal_bytes - then->literal_bytes);
+	fprintf(f, "\t\t\"tag_hits\": %"PRId64", \"tag_misses\": %"PRId64", \"inserts\": %"PRId64",\n",
+		now->tag_hits - then->tag_hits, now->tag_misses - then->tag_misses,
+		now->inserts - then->inserts);
+	fprintf(f, "\t\t\"mask_escalations\": %"PRId64",\n", now->mask_escalations - then->mask_escalations);
+	fprintf(f, "\t\t\"lazy_windows\": %"PRId64", \"lazy_candidates\": %"PRId64", \"lazy_gain\": %"PRId64,
+		now->lazy_windows - then->lazy_windows, now->lazy_candidates - then->lazy_candidates,
+		now->lazy_gain - then->lazy_gain);
+	fprintf(f, ",\n\t\t\"zero_runs\": %"PRId64, now->zero_runs - then->zero_runs);
+	stats_json_hist(f, "match_length_log2", now->len_hist, then->len_hist);
+	stats_json_hist(f, "match_distance_log2", now->dist_hist, then->dist_hist);
+}
+
+static void stats_json_begin(rzip_control *control)
+{
+	FILE *f = control->stats_file;
+
+	/* Past the opening bracket, earlier files need a separator */
+	if (!control->stats_first)
+		fputs(",\n", f);
+	control->stats_first = false;
+	fputs("{\n\t\"file\": ", f);
+	stats_json_string(f, STDIN ? "-" : control->infile);
+	fputs(",\n\t\"rzip_level\": ", f);
+	if (control->rzip_auto)
+		fputs("\"auto\"", f);
+	else
+		fprintf(f, "%d", control->rzip_compression_level);
+	fprintf(f, ", \"compression_level\": %d, \"rzip_threads\": %d,\n",
+		control->compression_level, control->rzip_threads);
+	fprintf(f, "\t\"max_chunk\": %"PRId64", \"reference_bytes\": %"PRId64", \"global\": %s,\n",
+		control->max_chunk, control->ref_size, GLOBAL_INDEX ? "true" : "false");
+	fputs("\t\"chunks\": [", f);
+}
+
+static void stats_json_chunk(rzip_control *control, struct rzip_state *st,
+			     const struct rzip_stats *then)
+{
+	FILE *f = control->stats_file;
+
+	fprintf(f, "%s\n\t{\n\t\t\"chunk\": %"PRId64", \"offset\": %"PRId64",\n",
+		then->chunks ? "," : "", then->chunks, then->bytes);
+	fprintf(f, "\t\t\"rzip_level\": %d,\n", (int)(st->level - levels));
+	fprintf(f, "\t\t\"hash_table_bytes\": %"PRId64", \"hash_fill\": %.4f, \"minimum_tag_mask\": %"PRId64",\n",
+		st->fill_bytes, st->fill, (i64)st->fill_mask);
+	stats_json_counts(f, &st->stats, then);
+	fputs("\n\t}", f);
+}
+
+static void stats_json_end(rzip_control *control, struct rzip_state *st)
+{
+	FILE *f = control->stats_file;
+	struct rzip_stats none;
+
+	memset(&none, 0, sizeof(none));
+	fputs("\n\t],\n\t\"totals\": {\n", f);
+	fprintf(f, "\t\t\"chunks\": %"PRId64",\n", st->stats.chunks);
+	stats_json_counts(f, &st->stats, &none);
+	fputs("\n\t}\n}", f);
+}
+
 /* compress a chunk of an open file. Assumes that the file is able to
    be mmap'd and is seekable */
 static inline void
@@ -881,9 +2889,19 @@ rzip_chunk(rzip_control *control, struct rzip_state *st, int fd_in, int fd_out,
 	st->ss = open_stream_out(control, fd_out, NUM_STREAMS, st->chunk_size, st->chunk_bytes);
 	if (unlikely(!st->ss))
 		fatal("Failed to open streams in rzip_chunk\n");
+	if (STDIN)
+		size_stdin_streams(control, st->ss);
 
 	print_verbose("Beginning rzip pre-processing phase\n");
-	hash_search(control, st, pct_base, pct_multiple);
+	if (control->stats_file) {
+		struct rzip_stats then = st->stats;
+
+		hash_search(control, st, pct_base, pct_multiple);
+		stats_json_chunk(control, st, &then);
+	} else
+		hash_search(control, st, pct_base, pct_multiple);
+	if (STDIN)
+		stop_stdin_reader(control, st);
 
 	/* unmap buffer before closing and reallocating streams */
 	if (unlikely(munmap(sb->buf_low, sb->size_low))) {
@@ -891,9 +2909,16 @@ rzip_chunk(rzip_control *control, struct rzip_state *st, int fd_in, int fd_out,
 		fatal("Failed to munmap in rzip_chunk\n");
 	}
 	if (!STDIN) {
-		if (unlikely(munmap(sb->buf_high, sb->size_high))) {
-			close_stream_out(control, st->ss);
-			fatal("Failed to munmap in rzip_chunk\n");
+		int i;
+
+		if (sb->high_misses)
+			print_maxverbose("Sliding mmap high windows of %'"PRId64" bytes: %'"PRId64" hits, %'"PRId64" remaps, %'"PRId64" read aheads\n",
+					 sb->high_length, sb->high_hits, sb->high_misses, sb->readaheads);
+		for (i = 0; i < SB_WINDOWS; i++) {
+			if (sb->high[i].buf && unlikely(munmap(sb->high[i].buf, sb->high[i].size))) {
+				close_stream_out(control, st->ss);
+				fatal("Failed to munmap in rzip_chunk\n");
+			}
 		}
 	}
 
@@ -919,6 +2944,236 @@ static void clear_sslist(struct rzip_state *st)
 }
 
 /* compress a whole file chunks at a time */
+/* The number of bytes needed for offsets into a chunk and whatever it can
+ * match before it */
+static char chunk_byte_width(i64 size)
+{
+	int bits = 8;
+
+	while (size >> bits > 0)
+		bits++;
+	return bits / 8 + !!(bits % 8);
+}
+
+static void add_stats(struct rzip_stats *to, const struct rzip_stats *from)
+{
+	int i;
+
+	to->chunks += from->chunks;
+	to->bytes += from->bytes;
+	to->search_time += from->search_time;
+	to->inserts += from->inserts;
+	to->literals += from->literals;
+	to->literal_bytes += from->literal_bytes;
+	to->matches += from->matches;
+	to->match_bytes += from->match_bytes;
+	to->tag_hits += from->tag_hits;
+	to->tag_misses += from->tag_misses;
+	to->mask_escalations += from->mask_escalations;
+	to->lazy_windows += from->lazy_windows;
+	to->lazy_candidates += from->lazy_candidates;
+	to->lazy_gain += from->lazy_gain;
+	to->zero_runs += from->zero_runs;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		to->len_hist[i] += from->len_hist[i];
+		to->dist_hist[i] += from->dist_hist[i];
+	}
+}
+
+/* Chunk threads search several chunks of a file at once, each with its own
+ * copy of the control and rzip state, so its own mapping, hash table and
+ * checksum worker. Their streams are held back in ram and handed to the
+ * back end threads in chunk order, so the archive is laid out just as if
+ * the chunks had been searched one by one. */
+struct chunk_job {
+	rzip_control control;
+	struct rzip_state st;
+	i64 offset;
+	pthread_t thread;
+};
+
+/* The ram a chunk job takes for its mapping and hash table. With -R auto
+ * it may use any of the levels choose_level picks from. */
+static i64 chunk_job_ram(rzip_control *control, i64 chunk)
+{
+	int level = control->rzip_auto ? 5 : control->rzip_compression_level;
+	int last = control->rzip_auto ? 9 : level;
+	struct rzip_state hs;
+	i64 hash = 0;
+
+	memset(&hs, 0, sizeof(hs));
+	hs.chunk_size = chunk;
+	for (; level <= last; level++) {
+		hs.level = &levels[level];
+		hash = MAX(hash, hash_table_size(control, &hs));
+	}
+	return chunk + hash;
+}
+
+/* How many chunks to search at once. The mappings and hash tables of all
+ * of them must fit in the ram for the main mapping, with room for one more
+ * chunk of output held back until the chunks before it are written. Unless
+ * a window is set chunks are made small enough for that, trading range for
+ * matches for speed, but fewer are searched at once rather than letting the
+ * hash tables take most of the share of each. */
+static int chunk_threads(rzip_control *control)
+{
+	int n = control->chunk_threads, i;
+
+	if (n < 2)
+		return 1;
+	if (STDIN || GLOBAL_INDEX) {
+		print_verbose("Chunk threads are not used with STDIN or --global\n");
+		return 1;
+	}
+	if (!UNLIMITED && !control->window) {
+		i64 share, size = 0;
+
+		for (; n > 1; n--) {
+			share = size = control->maxram / (n + 1);
+			for (i = 0; i < 4 && chunk_job_ram(control, size) > share; i++)
+				size -= chunk_job_ram(control, size) - share;
+			if (size >= share / 2)
+				break;
+		}
+		if (n < 2) {
+			print_verbose("Not enough ram for the hash tables of chunks searched at once\n");
+			return 1;
+		}
+		round_to_page(&size);
+		control->max_chunk = MIN(control->max_chunk, size);
+	}
+	if (control->st_size <= control->max_chunk)
+		return 1;
+	n = MIN(n, (control->maxram - control->max_chunk) / chunk_job_ram(control, control->max_chunk));
+	if (n < 2) {
+		print_verbose("Not enough ram to search chunks of %'"PRId64" bytes at once\n",
+			      control->max_chunk);
+		return 1;
+	}
+	control->max_mmap = MIN(control->max_mmap, control->max_chunk);
+	limit_captured(control->maxram - n * chunk_job_ram(control, control->max_chunk));
+	print_verbose("Searching up to %'d chunks of %'"PRId64" bytes at once\n", n, control->max_chunk);
+	return n;
+}
+
+static void *chunk_thread(void *data)
+{
+	struct chunk_job *job = data;
+	rzip_control *control = &job->control;
+	struct rzip_state *st = &job->st;
+
+	init_sliding_mmap(control, st, st->fd_in, job->offset);
+	start_cksum_worker(control);
+	hash_search(control, st, 0, 0);
+	stop_cksum_worker(control);
+	free_hash_table(st);
+	return NULL;
+}
+
+/* Map the chunk at offset and start a thread searching it. Returns its size */
+static i64 start_chunk_job(rzip_control *control, struct rzip_state *st, struct chunk_job *job,
+			   int fd_out, i64 offset, i64 len)
+{
+	rzip_control *jc = &job->control;
+	struct rzip_state *js = &job->st;
+
+	memcpy(jc, control, sizeof(*jc));
+	/* Not the locks and threads of the main control */
+	init_mutex(control, &jc->control_lock);
+	memset(&jc->checksum, 0, sizeof(jc->checksum));
+	memset(&jc->reader, 0, sizeof(jc->reader));
+	memset(&jc->prefetch, 0, sizeof(jc->prefetch));
+	memcpy(js, st, sizeof(*js));
+	js->hash_table = NULL;
+	memset(&js->stats, 0, sizeof(js->stats));
+	js->chunk_size = js->mmap_size = MIN(control->max_chunk, len);
+	job->offset = offset;
+
+	jc->sb.buf_low = (uchar *)mmap(NULL, js->chunk_size, PROT_READ, MAP_SHARED, st->fd_in, offset);
+	if (unlikely(jc->sb.buf_low == MAP_FAILED))
+		fatal("Failed to mmap %s\n", control->infile);
+	jc->sb.orig_offset = offset;
+	/* The whole file hash is fed in order by the main thread, and
+	 * progress is shown by it too */
+	jc->flags &= ~(FLAG_HASHED | FLAG_SHOW_PROGRESS);
+	gcry_md_open(&jc->crc_handle, *control->crc_gcode, GCRY_MD_FLAG_SECURE);
+	if (unlikely(jc->crc_handle == NULL))
+		fatal("Cannot create CRC Handle in start_chunk_job\n");
+
+	js->hist_size = control->ref_size ? control->ref_size + offset : 0;
+	js->chunk_bytes = chunk_byte_width(js->chunk_size + js->hist_size);
+	control->eof = js->chunk_size == len;
+	js->ss = open_stream_out(control, fd_out, NUM_STREAMS, js->chunk_size, js->chunk_bytes);
+	if (unlikely(!js->ss))
+		fatal("Failed to open streams in start_chunk_job\n");
+	capture_stream_out(js->ss);
+
+	create_pthread(control, &job->thread, NULL, chunk_thread, job);
+	return js->chunk_size;
+}
+
+/* Wait for the search of a chunk, then write its streams */
+static void finish_chunk_job(rzip_control *control, struct rzip_state *st, struct chunk_job *job)
+{
+	rzip_control *jc = &job->control;
+	struct rzip_state *js = &job->st;
+	struct rzip_stats then = st->stats;
+
+	release_stream_out(control, js->ss);
+	if (HAS_HASH)
+		gcry_md_write(control->hash_handle, jc->sb.buf_low, js->chunk_size);
+	join_pthread(control, job->thread, NULL);
+	pthread_mutex_destroy(&jc->control_lock);
+	gcry_md_close(jc->crc_handle);
+	if (unlikely(munmap(jc->sb.buf_low, js->chunk_size)))
+		fatal("Failed to munmap in finish_chunk_job\n");
+
+	add_stats(&st->stats, &js->stats);
+	st->fill_bytes = js->fill_bytes;
+	st->fill = js->fill;
+	st->fill_mask = js->fill_mask;
+	if (control->stats_file)
+		stats_json_chunk(control, st, &then);
+
+	if (unlikely(replay_stream_out(control, js->ss)))
+		fatal("Failed to flush/close streams in finish_chunk_job\n");
+	st->ss = js->ss;
+	add_to_sslist(control, st);
+	print_progress("Total: %2d%%  \r", (int)(100.0 * (job->offset + js->chunk_size) / control->st_size));
+}
+
+/* Search the whole file with up to nchunks chunk threads, starting the
+ * next chunk as each one is written. Returns the number of chunks. */
+static int rzip_chunks_parallel(rzip_control *control, struct rzip_state *st, int fd_out,
+				i64 len, int nchunks)
+{
+	struct chunk_job *jobs = calloc(sizeof(struct chunk_job), nchunks);
+	i64 offset = 0, size;
+	int running, chunks = 0, i;
+
+	if (unlikely(!jobs))
+		fatal("Failed to allocate chunk jobs in rzip_chunks_parallel\n");
+	for (running = 0; running < nchunks && len > 0; running++) {
+		size = start_chunk_job(control, st, &jobs[running], fd_out, offset, len);
+		offset += size;
+		len -= size;
+	}
+	for (i = 0; running; i = (i + 1) % nchunks) {
+		finish_chunk_job(control, st, &jobs[i]);
+		chunks++;
+		running--;
+		if (len > 0) {
+			size = start_chunk_job(control, st, &jobs[i], fd_out, offset, len);
+			offset += size;
+			len -= size;
+			running++;
+		}
+	}
+	dealloc(jobs);
+	return chunks;
+}
+
 void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 {
 	struct sliding_buffer *sb = &control->sb;
@@ -931,7 +3186,7 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	 */
 	struct timeval current, start, last;
 	i64 len = 0, last_chunk = 0;
-	int pass = 0, passes, j;
+	int pass = 0, passes, nchunks, j;
 	double chunkmbs, tdiff;
 	struct rzip_state *st;
 	struct statvfs fbuf;
@@ -948,14 +3203,13 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 		if (unlikely(control->hash_handle == NULL))
 			fatal("Cannot create %s Handle in rzip_fd\n", *control->hash_label);
 	}
-	cksem_init(control, &control->cksumsem);
-	cksem_post(control, &control->cksumsem);
+	start_cksum_worker(control);
 
 	st = calloc(sizeof(*st), 1);
 	if (unlikely(!st))
 		fatal("Failed to allocate control state in rzip_fd\n");
 
-	if (LZO_COMPRESS) {
+	if (LZO_COMPRESS || AUTO_COMPRESS) {
 		if (unlikely(lzo_init() != LZO_E_OK)) {
 			dealloc(st);
 			fatal("lzo_init() failed\n");
@@ -992,6 +3246,9 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 		}
 	}
 
+	init_hash_indexes(st);
+	init_reference(control, st);
+
 	/* Optimal use of ram involves using no more than 2/3 of it, so we
 	 * allocate 1/3 of it to the main buffer and use a sliding mmap
 	 * buffer to work on 2/3 ram size, leaving enough ram for the
@@ -1008,9 +3265,17 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 		control->max_chunk = control->window * CHUNK_MULTIPLE;
 	else
 		control->max_chunk = control->ramsize / 3 * 2;
+	/* Hash table entries only hold offsets into a chunk of up to 1TB,
+	 * less the size of any reference file */
+	if (control->max_chunk > st->ref_base) {
+		print_verbose("Limiting chunk size to %'"PRId64" bytes\n", st->ref_base);
+		control->max_chunk = st->ref_base;
+	}
 	control->max_mmap = MIN(control->max_mmap, control->max_chunk);
 	if (control->max_chunk < control->st_size)
 		round_to_page(&control->max_chunk);
+	nchunks = chunk_threads(control);
+	init_global(control, st, fd_in);
 
 	if (!STDIN)
 		st->chunk_size = MIN(control->max_chunk, len);
@@ -1023,8 +3288,8 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	st->fd_in = fd_in;
 	st->fd_out = fd_out;
 	st->stdin_eof = 0;
-
-	init_hash_indexes(st);
+	if (control->stats_file)
+		stats_json_begin(control);
 
 	passes = 0;
 
@@ -1033,15 +3298,19 @@ void rzip_fd(rzip_control *control, int fd_in, int fd_out)
 	gettimeofday(&start, NULL);
 
 	prepare_streamout_threads(control);
+	init_match_kernels(control);
+	init_cdc_gear();
 	control->do_mcpy = single_mcpy;
-	control->next_tag = &single_next_tag;
-	control->full_tag = &single_full_tag;
 	control->match_len = &single_match_len;
 
+	if (nchunks > 1) {
+		pass = rzip_chunks_parallel(control, st, fd_out, len, nchunks);
+		len = 0;
+	}
+
 	while (!pass || len > 0 || (STDIN && !st->stdin_eof)) {
 		double pct_base, pct_multiple;
 		i64 offset = s.st_size - len;
-		int bits = 8;
 
 		st->chunk_size = control->max_chunk;
 		st->mmap_size = control->max_mmap;
@@ -1061,7 +3330,7 @@ retry:
 			if (sb->buf_low == MAP_FAILED) {
 				if (unlikely(errno != ENOMEM)) {
 					close_streamout_threads(control);
-					dealloc(st->hash_table);
+					free_hash_table(st);
 					dealloc(st);
 					fatal("Failed to mmap %s\n", control->infile);
 				}
@@ -1069,21 +3338,27 @@ retry:
 				round_to_page(&st->mmap_size);
 				if (unlikely(!st->mmap_size)) {
 					close_streamout_threads(control);
-					dealloc(st->hash_table);
+					free_hash_table(st);
 					dealloc(st);
 					fatal("Unable to mmap any ram\n");
 				}
 				goto retry;
 			}
 			st->chunk_size = st->mmap_size;
-			mmap_stdin(control, sb->buf_low, st);
+			start_stdin_reader(control, st, sb->buf_low);
 		} else {
-			/* NOTE The buf is saved here for !STDIN mode */
-			sb->buf_low = (uchar *)mmap(sb->buf_low, st->mmap_size, PROT_READ, MAP_SHARED, fd_in, offset);
+			/* NOTE The buf is saved here for !STDIN mode. The
+			 * prefetch thread may have mapped it already. */
+			uchar *buf = take_prefetch(control, offset, st->mmap_size);
+
+			if (buf)
+				sb->buf_low = buf;
+			else
+				sb->buf_low = (uchar *)mmap(sb->buf_low, st->mmap_size, PROT_READ, MAP_SHARED, fd_in, offset);
 			if (sb->buf_low == MAP_FAILED) {
 				if (unlikely(errno != ENOMEM)) {
 					close_streamout_threads(control);
-					dealloc(st->hash_table);
+					free_hash_table(st);
 					dealloc(st);
 					fatal("Failed to mmap %s\n", control->infile);
 				}
@@ -1091,7 +3366,7 @@ retry:
 				round_to_page(&st->mmap_size);
 				if (unlikely(!st->mmap_size)) {
 					close_streamout_threads(control);
-					dealloc(st->hash_table);
+					free_hash_table(st);
 					dealloc(st);
 					fatal("Unable to mmap any ram\n");
 				}
@@ -1100,8 +3375,6 @@ retry:
 			if (st->mmap_size < st->chunk_size) {
 				print_maxverbose("Enabling sliding mmap mode and using mmap of %'"PRId64" bytes with window of %'"PRId64" bytes\n", st->mmap_size, st->chunk_size);
 				control->do_mcpy = &sliding_mcpy;
-				control->next_tag = &sliding_next_tag;
-				control->full_tag = &sliding_full_tag;
 				control->match_len = &sliding_match_len;
 			}
 		}
@@ -1125,12 +3398,12 @@ retry:
 		 * This allows archives of different chunk sizes to have
 		 * optimal byte width entries. When working with stdin we
 		 * won't know in advance how big it is so it will always be
-		 * rounded up to the window size. */
-		while (st->chunk_size >> bits > 0)
-			bits++;
-		st->chunk_bytes = bits / 8;
-		if (bits % 8)
-			st->chunk_bytes++;
+		 * rounded up to the window size. Matches into the reference
+		 * file or earlier chunks reach back over all of them. */
+		st->hist_size = 0;
+		if (control->ref_size || GLOBAL_INDEX)
+			st->hist_size = control->ref_size + offset;
+		st->chunk_bytes = chunk_byte_width(st->chunk_size + st->hist_size);
 		print_maxverbose("Byte width: %'d\n", st->chunk_bytes);
 
 		if (STDIN)
@@ -1172,6 +3445,7 @@ retry:
 
 		if (st->chunk_size == len)
 			control->eof = 1;
+		start_prefetch(control, st, fd_in, offset, len);
 		rzip_chunk(control, st, fd_in, fd_out, offset, pct_base, pct_multiple);
 
 		/* st->chunk_size may be shrunk in rzip_chunk */
@@ -1179,18 +3453,22 @@ retry:
 		len -= st->chunk_size;
 		if (unlikely(len > 0 && control->eof)) {
 			close_streamout_threads(control);
-			dealloc(st->hash_table);
+			free_hash_table(st);
 			dealloc(st);
 			fatal("Wrote EOF to file yet chunk_size was shrunk, corrupting archive.\n");
 		}
 	}
 
 	if (likely(st->hash_table))
-		dealloc(st->hash_table);
+		free_hash_table(st);
+	close_reference(control);
+	close_global(control);
+	stop_cksum_worker(control);
 	if (unlikely(!close_streamout_threads(control))) {
 		dealloc(st);
 		fatal("Failed to close_streamout_threads in rzip_fd\n");
 	}
+	release_buffer_pool(control);
 
 	if (HAS_HASH) {
 		/* if we're using an XOF function, i.e. SLACK128, then use md_extract */
@@ -1244,6 +3522,13 @@ retry:
 	print_maxverbose("inserts=%'u match %.3f\n",
 	       (unsigned int)st->stats.inserts,
 	       (1.0 + st->stats.match_bytes) / st->stats.literal_bytes);
+	if (st->stats.lazy_windows)
+		print_maxverbose("lazy windows=%'"PRId64" candidates=%'"PRId64" bytes gained=%'"PRId64"\n",
+				 st->stats.lazy_windows, st->stats.lazy_candidates, st->stats.lazy_gain);
+	if (st->stats.zero_runs)
+		print_maxverbose("zero runs=%'"PRId64"\n", st->stats.zero_runs);
+	if (control->stats_file)
+		stats_json_end(control, st);
 
 	if (!STDIN)
 		print_output("%s - ", control->infile);
@@ -24,6 +24,7 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <pthread.h>
 #include <bzlib.h>
@@ -71,15 +72,25 @@ static struct compress_thread {
 	i64 c_len;	/* Data length compressed */
 	cksem_t cksem;  /* This thread's semaphore */
 	struct stream_info *sinfo;
-	int streamno;
+	int streamno;	/* -1 for the block directory ending a chunk */
 	uchar salt[SALT_LEN];
+	struct backend_job job;
+	bool ready;	/* compressed, waiting for the writer */
 } *cthreads;
 
-typedef struct stream_thread_struct {
-	int i;		/* this is the current thread */
-	rzip_control *control;
-	struct stream_info *sinfo;
-} stream_thread_struct;
+/* Back end jobs are run by a pool of worker threads started as they are
+ * first needed and kept for the rest of the run, across streams, chunks and
+ * files. Jobs are taken in the order they were queued. */
+static struct backend_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signalled when a job is queued */
+	pthread_cond_t done;	/* broadcast when a job is done */
+	struct backend_job *head;
+	struct backend_job **tail;
+	int workers;		/* threads started */
+	int pending;		/* jobs queued or running */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	   NULL, &pool.head, 0, 0 };
 
 extern const int zstd_compression_level[10];
 extern const char *zstd_strategies[10];
@@ -88,6 +99,18 @@ static int output_thread;
 static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
 
+/* Compressed blocks are written by one writer thread in the order they were
+ * queued, in out_slots slots, twice the compression threads, so blocks done
+ * early wait in order behind a slow one while their workers go on to the
+ * next. No more than control->threads blocks are uncompressed at once, as
+ * open_stream_out budgets ram for. */
+static int out_slots;
+static int input_thread;	/* next slot to be filled */
+static int uncompressed;
+static bool writer_stop;
+static pthread_t writer_thread;
+static void *output_writer(void *data);
+
 static unsigned save_threads = 0;	// need for multiple chunks to restore thread count
 static i64 limit = 0;			// save for open_stream_out
 static i64 stream_bufsize = 0;		// save for open_stream_out
@@ -127,6 +150,13 @@ static bool cond_broadcast(rzip_control *control, pthread_cond_t *cond)
 	return true;
 }
 
+static bool cond_signal(rzip_control *control, pthread_cond_t *cond)
+{
+	if (unlikely(pthread_cond_signal(cond)))
+		fatal("Failed to pthread_cond_signal\n");
+	return true;
+}
+
 bool create_pthread(rzip_control *control, pthread_t *thread, pthread_attr_t * attr,
 	void * (*start_routine)(void *), void *arg)
 {
@@ -149,6 +179,204 @@ bool join_pthread(rzip_control *control, pthread_t th, void **thread_return)
 	return true;
 }
 
+/* A pool worker sets its nice value once, then runs jobs until the process
+ * exits */
+static void *backend_worker(void *data)
+{
+	rzip_control *control = data;
+	struct backend_job *job;
+
+	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
+		print_err("Warning, unable to set thread nice value %'d...Resetting to %'d\n", control->nice_val, control->current_priority);
+		setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
+	}
+
+	while (42) {
+		lock_mutex(control, &pool.lock);
+		while (!pool.head)
+			cond_wait(control, &pool.work, &pool.lock);
+		job = pool.head;
+		if (!(pool.head = job->next))
+			pool.tail = &pool.head;
+		unlock_mutex(control, &pool.lock);
+
+		job->fn(job);
+
+		lock_mutex(control, &pool.lock);
+		job->done = true;
+		pool.pending--;
+		cond_broadcast(control, &pool.done);
+		unlock_mutex(control, &pool.lock);
+	}
+	return NULL;
+}
+
+/* Make sure there are at least n workers. Every job that can be outstanding
+ * at once needs one, as a job may wait for an earlier one to write first. */
+static void start_backend_pool(rzip_control *control, int n)
+{
+	pthread_t thread;
+
+	lock_mutex(control, &pool.lock);
+	if (pool.workers < n)
+		print_maxverbose("Starting %'d back end worker threads\n", n - pool.workers);
+	for (; pool.workers < n; pool.workers++) {
+		create_pthread(control, &thread, NULL, backend_worker, control);
+		detach_pthread(control, &thread);
+	}
+	unlock_mutex(control, &pool.lock);
+}
+
+static void queue_backend_job(rzip_control *control, struct backend_job *job, void *(*fn)(void *),
+			      struct stream_info *sinfo, int i)
+{
+	job->fn = fn;
+	job->control = control;
+	job->sinfo = sinfo;
+	job->i = i;
+	job->done = false;
+	job->next = NULL;
+
+	lock_mutex(control, &pool.lock);
+	*pool.tail = job;
+	pool.tail = &job->next;
+	pool.pending++;
+	cond_signal(control, &pool.work);
+	unlock_mutex(control, &pool.lock);
+}
+
+static void wait_backend_job(rzip_control *control, struct backend_job *job)
+{
+	lock_mutex(control, &pool.lock);
+	while (!job->done)
+		cond_wait(control, &pool.done, &pool.lock);
+	unlock_mutex(control, &pool.lock);
+}
+
+/* Wait for every queued job, e.g. decompression run ahead of a stream that
+ * has been closed, before the memory it uses is freed */
+void wait_backend_pool(rzip_control *control)
+{
+	lock_mutex(control, &pool.lock);
+	while (pool.pending)
+		cond_wait(control, &pool.done, &pool.lock);
+	unlock_mutex(control, &pool.lock);
+}
+
+/* Stream, compressed and decompressed block buffers are recycled through a
+ * pool shared by all back end jobs instead of going back to malloc, and the
+ * page faults of fresh memory, for every block. Buffers are page aligned, in
+ * BUF_CLASS_STEPS size classes per power of two, and not zero filled. The
+ * page before each buffer holds its class and free list link. */
+#define BUF_CLASS_STEPS 4
+#define BUF_CLASSES (64 * BUF_CLASS_STEPS)
+
+struct pool_buf {
+	size_t size;		/* usable bytes, the size of its class */
+	int class;
+	struct pool_buf *next;
+};
+
+/* Stream buffers held back by all chunk threads, and the most they may
+ * hold. The chunk written next is not held to the limit, so it can always
+ * finish. */
+static struct captured_ram {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* broadcast when buffers are replayed */
+	i64 bytes;
+	i64 limit;
+} captured = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static struct buffer_pool {
+	pthread_mutex_t lock;
+	struct pool_buf *free[BUF_CLASSES];
+	int kept[BUF_CLASSES];	/* buffers in each free list */
+	i64 reused, allocated;
+} bufpool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { 0 }, 0, 0 };
+
+/* Get a buffer of at least len bytes */
+static void *get_buffer(rzip_control *control, i64 len)
+{
+	size_t size = round_up_page(control, MAX(len, 1)), base, step;
+	struct pool_buf *pb;
+	int class, bits;
+	void *mem;
+
+	bits = 63 - __builtin_clzll(size);
+	base = (size_t)1 << bits;
+	step = base / BUF_CLASS_STEPS;
+	class = (size - base + step - 1) / step;
+	size = round_up_page(control, base + class * step);
+	class += bits * BUF_CLASS_STEPS;
+
+	lock_mutex(control, &bufpool.lock);
+	pb = bufpool.free[class];
+	if (pb) {
+		bufpool.free[class] = pb->next;
+		bufpool.kept[class]--;
+		bufpool.reused++;
+	} else
+		bufpool.allocated++;
+	unlock_mutex(control, &bufpool.lock);
+	if (pb)
+		return (uchar *)pb + control->page_size;
+
+	if (posix_memalign(&mem, control->page_size, control->page_size + size))
+		return NULL;
+	pb = mem;
+	pb->size = size;
+	pb->class = class;
+	return (uchar *)pb + control->page_size;
+}
+
+/* How many bytes a buffer from get_buffer can hold */
+static size_t buffer_size(rzip_control *control, void *buf)
+{
+	return ((struct pool_buf *)((uchar *)buf - control->page_size))->size;
+}
+
+/* Return a buffer to the pool. No more of a class are kept than can be in
+ * use at once, an input and an output buffer per worker and one per stream,
+ * so the pool never holds more than the peak use. */
+static void put_buffer(rzip_control *control, void *buf)
+{
+	struct pool_buf *pb;
+
+	if (!buf)
+		return;
+	pb = (struct pool_buf *)((uchar *)buf - control->page_size);
+	lock_mutex(control, &bufpool.lock);
+	if (bufpool.kept[pb->class] < pool.workers * 2 + NUM_STREAMS) {
+		pb->next = bufpool.free[pb->class];
+		bufpool.free[pb->class] = pb;
+		bufpool.kept[pb->class]++;
+		pb = NULL;
+	}
+	unlock_mutex(control, &bufpool.lock);
+	free(pb);
+}
+
+/* Free the buffers kept, once a file is done */
+void release_buffer_pool(rzip_control *control)
+{
+	struct pool_buf *pb;
+	int i;
+
+	lock_mutex(control, &bufpool.lock);
+	if (bufpool.allocated)
+		print_maxverbose("Buffer pool reused %'"PRId64" of %'"PRId64" block buffers\n",
+				 bufpool.reused, bufpool.reused + bufpool.allocated);
+	for (i = 0; i < BUF_CLASSES; i++) {
+		while ((pb = bufpool.free[i])) {
+			bufpool.free[i] = pb->next;
+			free(pb);
+		}
+		bufpool.kept[i] = 0;
+	}
+	bufpool.reused = bufpool.allocated = 0;
+	unlock_mutex(control, &bufpool.lock);
+}
+
 /* just to keep things clean, declare function here
  * but move body to the end since it's a work function
 */
@@ -169,27 +397,47 @@ static int zstd_compress_buf(rzip_control *control, struct compress_thread *cthr
 	u32 dlen = round_up_page(control, cthread->s_len);
 	size_t zstd_ret;
 	uchar *c_buf;
+	ZSTD_CCtx *cctx;
 
 	if (LZ4_TEST) {
 		if (!lz4_compresses(control, cthread->s_buf, cthread->s_len))
 			return 0;
 	}
 
-	c_buf = malloc(dlen);
+	c_buf = get_buffer(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in zstd_compress_buf\n");
 		return -1;
 	}
 
 
+	cctx = ZSTD_createCCtx();
+	if (unlikely(!cctx)) {
+		print_err("Unable to allocate zstd context in zstd_compress_buf\n");
+		put_buffer(control, c_buf);
+		return -1;
+	}
+
 	print_maxverbose("Starting zstd backend compression thread %d. Using zstd compression level %d, %s strategy\n",
 			current_thread, control->zstd_level,
 			zstd_strategies[control->zstd_strategy]);
 
-	zstd_ret = ZSTD_compress( (void *)c_buf, (size_t) dlen,
-			      (const void *)cthread->s_buf, (size_t) cthread->s_len,
-			      /* map zstd compression level */
-			      control->zstd_level );
+	/* map zstd compression level, then the strategy stored in the magic
+	 * header and any window and long distance matching asked for */
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, control->zstd_level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_strategy, control->zstd_strategy);
+	if (control->zstd_wlog)
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, control->zstd_wlog);
+	if (control->zstd_ldm)
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+	/* Like lzma, use 2 threads per block unless NOBEMT is set. A libzstd
+	 * built without threads refuses this and compresses in one */
+	if (!NOBEMT && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, 2)))
+		print_maxverbose("Thread %d: libzstd has no multi-threading\n", current_thread);
+
+	zstd_ret = ZSTD_compress2(cctx, (void *)c_buf, (size_t) dlen,
+			      (const void *)cthread->s_buf, (size_t) cthread->s_len);
+	ZSTD_freeCCtx(cctx);
 
 	/* if compressed data is bigger then original data leave as
 	 * CTYPE_NONE */
@@ -208,7 +456,7 @@ static int zstd_compress_buf(rzip_control *control, struct compress_thread *cthr
 				ret = -1;
 				break;
 		}
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return ret;
 	}
 
@@ -217,12 +465,12 @@ static int zstd_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (unlikely(dlen >= cthread->c_len)) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_ZSTD;
 	return 0;
@@ -231,6 +479,7 @@ static int zstd_compress_buf(rzip_control *control, struct compress_thread *cthr
 static int bzip3_compress_buf(rzip_control *control, struct compress_thread *cthread, int current_thread)
 {
 	i64 c_len, c_size;
+	u32 block_size;
 	uchar *c_buf;
 
 	struct bz3_state *state;
@@ -241,7 +490,7 @@ static int bzip3_compress_buf(rzip_control *control, struct compress_thread *cth
 	}
 
 	c_size = round_up_page(control, cthread->s_len + cthread->s_len / 50 + 30);
-	c_buf = malloc(c_size);
+	c_buf = get_buffer(control, c_size);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in bzip3_compress_buf\n");
 		return -1;
@@ -249,24 +498,27 @@ static int bzip3_compress_buf(rzip_control *control, struct compress_thread *cth
 	memcpy(c_buf, cthread->s_buf, cthread->s_len);
 
 	c_len = 0;
+	/* --auto has no bzip3 block size, so size the state to the block */
+	block_size = control->bzip3_block_size ? control->bzip3_block_size : MAX(cthread->s_len, BZIP3_MIN_BLOCK);
 	print_maxverbose("Starting bzip3 backend compression thread %d... block size = %d - %'"PRIu32" bytes...\n",
-		       current_thread, control->bzip3_bs, control->bzip3_block_size);
+		       current_thread, control->bzip3_bs, block_size);
 
-	state = bz3_new(control->bzip3_block_size);	// allocate bzip3 state
+	state = bz3_new(block_size);	// allocate bzip3 state
 	if (!state)
-		fatal("Failed to allocate %'"PRIu32" bytes bzip3 state.\n", control->bzip3_block_size);
+		fatal("Failed to allocate %'"PRIu32" bytes bzip3 state.\n", block_size);
 
         c_len = bz3_encode_block(state, c_buf, cthread->s_len);
 
 	if (unlikely(c_len >= cthread->c_len)) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
+		bz3_free(state);
 		return 0;
 	}
 
 	cthread->c_len = c_len;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_BZIP3;
 	bz3_free(state);				// free bzip3 state
@@ -291,7 +543,7 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 
 
 	c_size = round_up_page(control, cthread->s_len * 1.02);	/* increae buffer by 2% to prevent memory overrun */
-	c_buf = malloc(c_size);
+	c_buf = get_buffer(control, c_size);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in zpaq_compress_buf\n");
 		return -1;
@@ -318,13 +570,13 @@ static int zpaq_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (unlikely(c_len >= cthread->c_len)) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 	print_maxverbose("ZPAQ Thread %d Completed\n", current_thread);
 
 	cthread->c_len = c_len;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_ZPAQ;
 	return 0;
@@ -341,7 +593,7 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 			return 0;
 	}
 
-	c_buf = malloc(dlen);
+	c_buf = get_buffer(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in bzip2_compress_buf\n");
 		return -1;
@@ -357,12 +609,12 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 	if (bzip2_ret == BZ_OUTBUFF_FULL) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 
 	if (unlikely(bzip2_ret != BZ_OK)) {
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		print_maxverbose("Thread %d: BZ2 compress failed\n", current_thread);
 		return -1;
 	}
@@ -370,12 +622,12 @@ static int bzip2_compress_buf(rzip_control *control, struct compress_thread *cth
 	if (unlikely(dlen >= cthread->c_len)) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_BZIP2;
 	return 0;
@@ -387,7 +639,7 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	uchar *c_buf;
 	int gzip_ret;
 
-	c_buf = malloc(dlen);
+	c_buf = get_buffer(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in gzip_compress_buf\n");
 		return -1;
@@ -402,12 +654,12 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (gzip_ret == Z_BUF_ERROR) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 
 	if (unlikely(gzip_ret != Z_OK)) {
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		print_maxverbose("Thread %d: compress2 failed\n", current_thread);
 		return -1;
 	}
@@ -415,12 +667,12 @@ static int gzip_compress_buf(rzip_control *control, struct compress_thread *cthr
 	if (unlikely((i64)dlen >= cthread->c_len)) {
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
 		/* Incompressible, leave as CTYPE_NONE */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_GZIP;
 	return 0;
@@ -441,7 +693,7 @@ static int lzma_compress_buf(rzip_control *control, struct compress_thread *cthr
 	print_maxverbose("Starting lzma backend compression thread %'d...\n", current_thread);
 retry:
 	dlen = round_up_page(control, cthread->s_len * 1.02); // add 2% for lzma overhead to prevent memory overrun
-	c_buf = malloc(dlen);
+	c_buf = get_buffer(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in lzma_compress_buf\n");
 		return -1;
@@ -458,7 +710,7 @@ retry:
 		 * If NOBEMT is set, do not use multi-threading */
 	if (lzma_ret != SZ_OK) {
 		/* can pass -1 if not compressible! Thanks Lasse Collin */
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		if (lzma_ret == SZ_ERROR_MEM) {
 			if (control->compression_level > 1) {
 				control->compression_level--;
@@ -482,12 +734,12 @@ retry:
 	if (unlikely((i64)dlen >= cthread->c_len)) {
 		/* Incompressible, leave as CTYPE_NONE */
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		return 0;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_LZMA;
 	return 0;
@@ -525,7 +777,7 @@ static int lzo_compress_buf(rzip_control *control, struct compress_thread *cthre
 		return ret;
 	}
 
-	c_buf = malloc(dlen);
+	c_buf = get_buffer(control, dlen);
 	if (!c_buf) {
 		print_err("Unable to allocate c_buf in lzo_compress_buf");
 		goto out_free;
@@ -540,12 +792,12 @@ static int lzo_compress_buf(rzip_control *control, struct compress_thread *cthre
 	if (dlen >= in_len){
 		/* Incompressible, leave as CTYPE_NONE */
 		print_maxverbose("Thread %d: Incompressible block\n", current_thread);
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 		goto out_free;
 	}
 
 	cthread->c_len = dlen;
-	dealloc(cthread->s_buf);
+	put_buffer(control, cthread->s_buf);
 	cthread->s_buf = c_buf;
 	cthread->c_type = CTYPE_LZO;
 out_free:
@@ -553,6 +805,105 @@ out_free:
 	return ret;
 }
 
+/* --auto probes each block with a few slices spread across it and sends it
+ * to the strongest back end that still keeps up with the throughput target.
+ * Speeds are rough single thread MB/s for the levels --auto uses. */
+#define AUTO_SLICE	4096
+#define AUTO_SLICES	16
+#define AUTO_SAMPLE	(AUTO_SLICE * AUTO_SLICES)
+
+static const struct auto_backend {
+	uchar c_type;
+	const char *name;
+	int speed;
+} auto_backends[] = {
+	{ CTYPE_BZIP3,	"bzip3",	12 },
+	{ CTYPE_LZMA,	"lzma",		4 },
+	{ CTYPE_ZSTD,	"zstd",		150 },
+	{ CTYPE_LZO,	"lzo",		400 },
+};
+
+static uchar choose_backend(rzip_control *control, struct compress_thread *cthread, int current_thread)
+{
+	char sample[AUTO_SAMPLE], lz4_buf[LZ4_COMPRESSBOUND(AUTO_SAMPLE)];
+	i64 counts[256] = { 0 }, text = 0, len, step;
+	double entropy = 0, ratio, p;
+	int i, first, lz4_len;
+	uchar c_type;
+
+	if (cthread->s_len <= AUTO_SAMPLE) {
+		len = cthread->s_len;
+		memcpy(sample, cthread->s_buf, len);
+	} else {
+		len = AUTO_SAMPLE;
+		step = (cthread->s_len - AUTO_SLICE) / (AUTO_SLICES - 1);
+		for (i = 0; i < AUTO_SLICES; i++)
+			memcpy(sample + i * AUTO_SLICE, cthread->s_buf + i * step, AUTO_SLICE);
+	}
+
+	for (i = 0; i < len; i++) {
+		uchar ch = sample[i];
+
+		counts[ch]++;
+		if ((ch >= 32 && ch < 127) || ch == '\n' || ch == '\r' || ch == '\t')
+			text++;
+	}
+	for (i = 0; i < 256; i++) {
+		if (!counts[i])
+			continue;
+		p = (double)counts[i] / len;
+		entropy -= p * log2(p);
+	}
+	lz4_len = LZ4_compress_default(sample, lz4_buf, len, sizeof(lz4_buf));
+	ratio = lz4_len > 0 ? (double)lz4_len / len : 1;
+
+	if (entropy > 7.9 && ratio > 0.98) {
+		/* Random or already compressed. Nothing will gain on it */
+		c_type = CTYPE_NONE;
+		goto out;
+	}
+
+	/* Text does best with the BWT of bzip3 when its state fits in the
+	 * ram set aside for each thread. Other data goes to lzma first, and
+	 * data lz4 barely touches only to the fast back ends */
+	if (ratio > 0.9)
+		first = 2;
+	else if (text > len * 9 / 10 && cthread->s_len * 6 <= control->overhead
+			&& cthread->s_len <= BZIP3_BLOCK_SIZE_FROM_PROP(8))
+		first = 0;
+	else
+		first = 1;
+
+	if (control->auto_speed) {
+		for (i = first; i < (int)(sizeof(auto_backends) / sizeof(auto_backends[0])) - 1; i++)
+			if ((unsigned)auto_backends[i].speed * control->threads >= control->auto_speed)
+				break;
+	} else
+		i = first;
+	c_type = auto_backends[i].c_type;
+out:
+	print_verbose("Thread %d: %'"PRId64" byte block, entropy %.2f bits/byte, %'"PRId64"%% text, lz4 sample %.0f%%, using %s\n",
+		      current_thread, cthread->s_len, entropy, text * 100 / len, ratio * 100,
+		      c_type == CTYPE_NONE ? "none" : auto_backends[i].name);
+	return c_type;
+}
+
+static int auto_compress_buf(rzip_control *control, struct compress_thread *cthread, int current_thread)
+{
+	switch (choose_backend(control, cthread, current_thread)) {
+	case CTYPE_BZIP3:
+		return bzip3_compress_buf(control, cthread, current_thread);
+	case CTYPE_LZMA:
+		return lzma_compress_buf(control, cthread, current_thread);
+	case CTYPE_ZSTD:
+		return zstd_compress_buf(control, cthread, current_thread);
+	case CTYPE_LZO:
+		return lzo_compress_buf(control, cthread, current_thread);
+	}
+	/* Stored as it is, CTYPE_NONE */
+	return 0;
+}
+
 /*
   ***** DECOMPRESSION FUNCTIONS *****
 
@@ -568,7 +919,7 @@ static int zstd_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 	uchar *c_buf;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'d bytes for decompression\n", dlen);
 		ret = -1;
@@ -589,10 +940,10 @@ static int zstd_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 		print_err("Inconsistent length after decompression. Got %'d bytes, expected %'"PRId64"\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -607,7 +958,7 @@ static int bzip3_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 	struct bz3_state *state;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'"PRId64" bytes for decompression\n", dlen);
 		ret = -1;
@@ -615,7 +966,10 @@ static int bzip3_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 	}
 	memcpy(ucthread->s_buf, c_buf, ucthread->c_len);
 
-	state = bz3_new(control->bzip3_block_size);
+	/* Blocks --auto gave to bzip3 carry no block size in the magic */
+	state = bz3_new(control->bzip3_block_size ? control->bzip3_block_size : MAX(ucthread->u_len, BZIP3_MIN_BLOCK));
+	if (unlikely(!state))
+		fatal("Failed to allocate bzip3 state.\n");
 
 /* call proper decode function based on compile time ABI check */
 #ifdef LIBBZ3_ABI1
@@ -630,10 +984,10 @@ static int bzip3_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 		print_err("Inconsistent length after decompression. Got %'"PRId64" bytes, expected %'"PRId64"\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	bz3_free(state);
@@ -647,7 +1001,7 @@ static int zpaq_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 	int ret = 0;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'"PRId64" bytes for decompression\n", dlen);
 		ret = -1;
@@ -664,10 +1018,10 @@ static int zpaq_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 		print_err("Inconsistent length after decompression. Got %'"PRId64" bytes, expected %'"PRId64"\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -680,7 +1034,7 @@ static int bzip2_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 	uchar *c_buf;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'d bytes for decompression\n", dlen);
 		ret = -1;
@@ -698,10 +1052,10 @@ static int bzip2_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_
 		print_err("Inconsistent length after decompression. Got %'d bytes, expected %'"PRId64"\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -714,7 +1068,7 @@ static int gzip_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 	uchar *c_buf;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'"PRId64" bytes for decompression\n", dlen);
 		ret = -1;
@@ -732,10 +1086,10 @@ static int gzip_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_t
 		print_err("Inconsistent length after decompression. Got %'"PRId64" bytes, expected %'"PRId64"\n", dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -749,7 +1103,7 @@ static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucth
 	SizeT c_len = ucthread->c_len;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'"PRId64" bytes for decompression\n", (i64)dlen);
 		ret = -1;
@@ -769,10 +1123,10 @@ static int lzma_decompress_buf(rzip_control *control, struct uncomp_thread *ucth
 		print_err("Inconsistent length after decompression. Got %'"PRId64" bytes, expected %'"PRId64"\n", (i64)dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -785,7 +1139,7 @@ static int lzo_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_th
 	uchar *c_buf;
 
 	c_buf = ucthread->s_buf;
-	ucthread->s_buf = malloc(round_up_page(control, dlen));
+	ucthread->s_buf = get_buffer(control, dlen);
 	if (unlikely(!ucthread->s_buf)) {
 		print_err("Failed to allocate %'"PRIu32" bytes for decompression\n", (unsigned long)dlen);
 		ret = -1;
@@ -803,10 +1157,10 @@ static int lzo_decompress_buf(rzip_control *control __UNUSED__, struct uncomp_th
 		print_err("Inconsistent length after decompression. Got %'"PRIu32" bytes, expected %'"PRId64"\n", (unsigned long)dlen, ucthread->u_len);
 		ret = -1;
 	} else
-		dealloc(c_buf);
+		put_buffer(control, c_buf);
 out:
 	if (ret == -1) {
-		dealloc(ucthread->s_buf);
+		put_buffer(control, ucthread->s_buf);
 		ucthread->s_buf = c_buf;
 	}
 	return ret;
@@ -818,8 +1172,11 @@ out:
  * the data accordingly. */
 ssize_t put_fdout(rzip_control *control, void *offset_buf, ssize_t ret)
 {
-	if (!TMP_OUTBUF)
+	if (!TMP_OUTBUF) {
+		if (control->sparse)
+			return write_fdout(control, offset_buf, ret) ? ret : -1;
 		return write(control->fd_out, offset_buf, (size_t)ret);
+	}
 
 	if (unlikely(control->out_ofs + ret > control->out_maxlen)) {
 		/* The data won't fit in a temporary output buffer so we have
@@ -1089,7 +1446,6 @@ i64 get_readseek(rzip_control *control, int fd)
 
 bool prepare_streamout_threads(rzip_control *control)
 {
-	pthread_t *threads;
 	int i;
 
 	/* As we serialise the generation of threads during the rzip
@@ -1100,20 +1456,19 @@ bool prepare_streamout_threads(rzip_control *control)
 		++control->threads;
 	if (NO_COMPRESS)
 		control->threads = 1;
-	threads = control->pthreads = calloc(sizeof(pthread_t), control->threads);
-	if (unlikely(!threads))
-		fatal("Unable to calloc threads in prepare_streamout_threads\n");
-
-	cthreads = calloc(sizeof(struct compress_thread), control->threads);
-	if (unlikely(!cthreads)) {
-		dealloc(threads);
+	out_slots = control->threads * 2;
+	cthreads = calloc(sizeof(struct compress_thread), out_slots);
+	if (unlikely(!cthreads))
 		fatal("Unable to calloc cthreads in prepare_streamout_threads\n");
-	}
+	start_backend_pool(control, control->threads);
 
-	for (i = 0; i < control->threads; i++) {
+	for (i = 0; i < out_slots; i++) {
 		cksem_init(control, &cthreads[i].cksem);
 		cksem_post(control, &cthreads[i].cksem);
 	}
+	output_thread = input_thread = uncompressed = 0;
+	writer_stop = false;
+	create_pthread(control, &writer_thread, NULL, output_writer, control);
 	return true;
 }
 
@@ -1122,16 +1477,20 @@ bool close_streamout_threads(rzip_control *control)
 {
 	int i, close_thread = output_thread;
 
-	/* Wait for the threads in the correct order in case they end up
-	 * serialised */
-	for (i = 0; i < control->threads; i++) {
+	/* Wait for the slots in the order they are written */
+	for (i = 0; i < out_slots; i++) {
 		cksem_wait(control, &cthreads[close_thread].cksem);
 
-		if (++close_thread == control->threads)
+		if (++close_thread == out_slots)
 			close_thread = 0;
 	}
+
+	lock_mutex(control, &output_lock);
+	writer_stop = true;
+	cond_broadcast(control, &output_cond);
+	unlock_mutex(control, &output_lock);
+	join_pthread(control, writer_thread, NULL);
 	dealloc(cthreads);
-	dealloc(control->pthreads);
 	return true;
 }
 
@@ -1154,6 +1513,7 @@ void *open_stream_out(rzip_control *control, int f, unsigned int n, i64 chunk_li
 	sinfo->chunk_bytes = cbytes;
 	sinfo->num_streams = n;
 	sinfo->fd = f;
+	sinfo->eof = control->eof;
 
 	sinfo->s = calloc(sizeof(struct stream), n);
 	if (unlikely(!sinfo->s)) {
@@ -1335,7 +1695,7 @@ retest_malloc:
 	sinfo->bufsize = stream_bufsize;
 
 	for (i = 0; i < n; i++) {
-		sinfo->s[i].buf = calloc(sinfo->bufsize , 1);
+		sinfo->s[i].buf = get_buffer(control, sinfo->bufsize);
 		if (unlikely(!sinfo->s[i].buf)) {
 			fatal("Unable to malloc buffer of size %'"PRId64" in open_stream_out\n", sinfo->bufsize);
 			dealloc(sinfo->s);
@@ -1348,13 +1708,155 @@ retest_malloc:
 }
 
 
+/* List the 0.15+ chunks of the input on fd, walking back through their
+ * trailers from the hash at its end to the first chunk at first */
+bool find_chunks(rzip_control *control, int fd, i64 first)
+{
+	struct chunk_entry *list = NULL;
+	i64 pos, count = 0, size = 0, i;
+	struct stat st;
+
+	if (unlikely(fstat(fd, &st))) {
+		print_err("Failed to fstat input in find_chunks\n");
+		return false;
+	}
+	pos = st.st_size - (HAS_HASH ? *control->hash_len : 0);
+	if (unlikely(pos < first)) {
+		print_err("Input ends at %'"PRId64" before its first chunk\n", pos);
+		return false;
+	}
+	while (pos > first) {
+		i64 trailer[2], blocks, dir_ofs, len;
+
+		if (unlikely(pos - first < CHUNK_TRAILER_LEN ||
+			     pread(fd, trailer, CHUNK_TRAILER_LEN, pos - CHUNK_TRAILER_LEN) != CHUNK_TRAILER_LEN)) {
+			print_err("Failed to read chunk trailer before %'"PRId64"\n", pos);
+			goto error;
+		}
+		blocks = le64toh(trailer[0]);
+		dir_ofs = le64toh(trailer[1]);
+		if (unlikely(blocks < 0 || blocks > (pos - first) / BLOCK_ENTRY_LEN)) {
+			print_err("Invalid block count %'"PRId64" in chunk trailer\n", blocks);
+			goto error;
+		}
+		len = blocks * BLOCK_ENTRY_LEN;
+		if (ENCRYPT)
+			len = SALT_LEN + MAX(len, *control->enc_keylen);
+		pos -= CHUNK_TRAILER_LEN + len;
+		if (unlikely(dir_ofs < 2 || pos - dir_ofs < first)) {
+			print_err("Invalid block directory offset %'"PRId64" in chunk trailer\n", dir_ofs);
+			goto error;
+		}
+		if (count == size) {
+			struct chunk_entry *grown;
+
+			size = MAX(size * 2, 16);
+			grown = realloc(list, size * sizeof(struct chunk_entry));
+			if (unlikely(!grown))
+				fatal("Failed to realloc chunk list in find_chunks\n");
+			list = grown;
+		}
+		list[count].dir = pos;
+		list[count].blocks = blocks;
+		pos -= dir_ofs;
+		list[count++].start = pos;
+	}
+
+	/* Found last first */
+	for (i = 0; i < count / 2; i++) {
+		struct chunk_entry tmp = list[i];
+
+		list[i] = list[count - 1 - i];
+		list[count - 1 - i] = tmp;
+	}
+	print_maxverbose("Found %'"PRId64" chunks from their trailers\n", count);
+	control->chunk_list = list;
+	control->chunk_count = count;
+	return true;
+error:
+	dealloc(list);
+	return false;
+}
+
+/* Read the block directory of blocks entries at dir_ofs in the chunk, leaving
+ * the last_head of each stream as the index of its first block */
+static bool read_directory(rzip_control *control, struct stream_info *sinfo, i64 dir_ofs, i64 blocks)
+{
+	i64 len, ofs = 0, i;
+	uchar salt[SALT_LEN], *buf, *p;
+	int j;
+
+	print_maxverbose("Reading block directory at %'"PRId64"\n", dir_ofs);
+	if (unlikely(dir_ofs < 0 || read_seekto(control, sinfo, dir_ofs)))
+		return false;
+	len = blocks * BLOCK_ENTRY_LEN;
+	if (ENCRYPT) {
+		if (unlikely(read_buf(control, sinfo->fd, salt, SALT_LEN)))
+			return false;
+		len = MAX(len, *control->enc_keylen);
+	}
+	buf = malloc(MAX(len, 1));
+	sinfo->dir = calloc(MAX(blocks, 1), sizeof(struct block_entry));
+	if (unlikely(!buf || !sinfo->dir))
+		fatal("Failed to malloc block directory in read_directory\n");
+	if (unlikely(len && read_buf(control, sinfo->fd, buf, len)))
+		goto error;
+	if (unlikely(ENCRYPT && !lrz_decrypt(control, buf, len, salt, LRZ_DECRYPT)))
+		goto error;
+
+	for (i = 0, p = buf; i < blocks; i++, p += BLOCK_ENTRY_LEN) {
+		struct block_entry *entry = &sinfo->dir[i];
+
+		entry->streamno = p[0];
+		entry->c_type = p[1];
+		memcpy(&entry->c_len, p + 2, 8);
+		memcpy(&entry->u_len, p + 10, 8);
+		entry->c_len = le64toh(entry->c_len);
+		entry->u_len = le64toh(entry->u_len);
+		entry->offset = ofs;
+		if (unlikely(entry->streamno >= sinfo->num_streams || entry->c_len < 1 || entry->u_len < 1 ||
+				entry->c_len > dir_ofs)) {
+			print_err("Invalid block %'"PRId64" of stream %'d in block directory, compressed len %'"PRId64" uncompressed %'"PRId64"\n",
+				  i, entry->streamno, entry->c_len, entry->u_len);
+			if (ENCRYPT)
+				print_err("Wrong password?\n");
+			goto error;
+		}
+		/* if encryption used, each block has its salt and is padded */
+		if (ENCRYPT)
+			ofs += SALT_LEN;
+		ofs += MAX(entry->c_len, *control->enc_keylen);
+	}
+	if (unlikely(ofs != dir_ofs)) {
+		print_err("Blocks end at %'"PRId64" but the block directory is at %'"PRId64"\n", ofs, dir_ofs);
+		goto error;
+	}
+	sinfo->dir_blocks = blocks;
+	sinfo->total_read = dir_ofs + (ENCRYPT ? SALT_LEN : 0) + len + CHUNK_TRAILER_LEN;
+	dealloc(buf);
+
+	for (j = 0; j < sinfo->num_streams; j++) {
+		for (i = 0; i < blocks && sinfo->dir[i].streamno != j; i++)
+			;
+		if (i == blocks)
+			sinfo->s[j].eos = 1;
+		else
+			sinfo->s[j].last_head = i;
+	}
+	return true;
+error:
+	dealloc(buf);
+	dealloc(sinfo->dir);
+	return false;
+}
+
 /* prepare a set of n streams for reading on file descriptor f */
 void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 {
 	struct uncomp_thread *ucthreads;
 	struct stream_info *sinfo;
+	struct chunk_entry *chunk = NULL;
 	int total_threads, i;
-	pthread_t *threads;
 	i64 header_length;
 
 	sinfo = calloc(sizeof(struct stream_info), 1);
@@ -1367,16 +1869,12 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		total_threads = control->threads + 2;
 	else
 		total_threads = control->threads + 1;
-	threads = control->pthreads = calloc(sizeof(pthread_t), total_threads);
-	if (unlikely(!threads))
-		return NULL;
-
 	sinfo->ucthreads = ucthreads = calloc(sizeof(struct uncomp_thread), total_threads);
 	if (unlikely(!ucthreads)) {
 		dealloc(sinfo);
-		dealloc(threads);
 		fatal("Unable to calloc ucthreads in open_stream_in\n");
 	}
+	start_backend_pool(control, total_threads);
 
 	sinfo->num_streams = n;
 	sinfo->fd = f;
@@ -1385,7 +1883,6 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 	sinfo->s = calloc(sizeof(struct stream), n);
 	if (unlikely(!sinfo->s)) {
 		dealloc(sinfo);
-		dealloc(threads);
 		dealloc(ucthreads);
 		return NULL;
 	}
@@ -1393,6 +1890,25 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 	sinfo->s[0].total_threads = 1;
 	sinfo->s[1].total_threads = total_threads - 1;
 
+	/* Since 0.15 the chunk, started by the chunk bytes just read, is found
+	 * in the list of chunks made from their trailers */
+	if (control->minor_version >= 15) {
+		i64 start = get_readseek(control, f) - 1, j;
+
+		if (!control->chunk_list && unlikely(!find_chunks(control, f, start)))
+			goto failed;
+		for (j = 0; j < control->chunk_count; j++) {
+			if (control->chunk_list[j].start == start) {
+				chunk = &control->chunk_list[j];
+				break;
+			}
+		}
+		if (unlikely(!chunk)) {
+			print_err("No chunk trailer found for the chunk at %'"PRId64"\n", start);
+			goto failed;
+		}
+	}
+
 	/* remove checks for lrzip < 0.6 */
 	if (control->major_version == 0) {
 		/* Read in flag that tells us if there are more chunks after
@@ -1436,6 +1952,10 @@ void *open_stream_in(rzip_control *control, int f, int n, char chunk_bytes)
 		sinfo->s[i].uthread_no = sinfo->s[i].base_thread;
 		sinfo->s[i].unext_thread = sinfo->s[i].base_thread;
 
+		/* No stream headers, the blocks are listed in the directory */
+		if (control->minor_version >= 15)
+			continue;
+
 		if (unlikely(ENCRYPT && read_buf(control, f, enc_head, SALT_LEN)))
 			goto failed;
 again:
@@ -1495,79 +2015,32 @@ again:
 		}
 	}
 
+	if (chunk && unlikely(!read_directory(control, sinfo, chunk->dir - sinfo->initial_pos, chunk->blocks)))
+		goto failed;
+
 	return (void *)sinfo;
 
 failed:
 	dealloc(sinfo->s);
 	dealloc(sinfo);
-	dealloc(threads);
 	dealloc(ucthreads);
 	return NULL;
 }
 
-/* Once the final data has all been written to the block header, we go back
- * and write SALT_LEN bytes of salt before it, and encrypt the header in place
- * by reading what has been written, encrypting it, and writing back over it.
- * This is very convoluted depending on whether a last_head value is written
- * to this block or not. See the callers of this function */
-static bool rewrite_encrypted(rzip_control *control, struct stream_info *sinfo, i64 ofs)
-{
-	uchar *buf, *head;
-	i64 cur_ofs;
-
-	cur_ofs = get_seek(control, sinfo->fd) - sinfo->initial_pos;
-	if (unlikely(cur_ofs == -1))
-		return false;
-	head = malloc(25 + SALT_LEN);
-	if (unlikely(!head))
-		fatal("Failed to malloc head in rewrite_encrypted\n");
-	buf = head + SALT_LEN;
-	gcry_create_nonce(head, SALT_LEN);
-	if (unlikely(seekto(control, sinfo, ofs - SALT_LEN)))
-		fatal("Failed to seekto buf ofs in rewrite_encrypted\n");
-	if (unlikely(write_buf(control, head, SALT_LEN)))
-		fatal("Failed to write_buf head in rewrite_encrypted\n");
-	if (unlikely(read_buf(control, sinfo->fd, buf, 25)))
-		fatal("Failed to read_buf buf in rewrite_encrypted\n");
-
-	if (unlikely(!lrz_encrypt(control, buf, 25, head)))
-		goto error;
-
-	if (unlikely(seekto(control, sinfo, ofs)))
-		fatal("Failed to seek back to ofs in rewrite_encrypted\n");
-	if (unlikely(write_buf(control, buf, 25)))
-		fatal("Failed to write_buf encrypted buf in rewrite_encrypted\n");
-	dealloc(head);
-	seekto(control, sinfo, cur_ofs);
-	return true;
-error:
-	dealloc(head);
-	return false;
-}
-
 /* Enter with s_buf allocated,s_buf points to the compressed data after the
  * backend compression and is then freed here */
 static void *compthread(void *data)
 {
-	stream_thread_struct *s = data;
-	rzip_control *control = s->control;
-	int current_thread = s->i;
+	struct backend_job *job = data;
+	rzip_control *control = job->control;
+	int current_thread = job->i;
 	struct compress_thread *cti;
 	struct stream_info *ctis;
 	int waited = 0, ret = 0;
 	i64 padded_len;
-	int write_len;
-
-	/* Make sure this thread doesn't already exist */
 
-	dealloc(data);
 	cti = &cthreads[current_thread];
 	ctis = cti->sinfo;
-
-	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
-		print_err("Warning, unable to set thread nice value %'d...Resetting to %'d\n", control->nice_val, control->current_priority);
-		setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
-	}
 	cti->c_type = CTYPE_NONE;
 	cti->c_len = cti->s_len;
 
@@ -1632,7 +2105,9 @@ retry:
 	 * than 64 bytes. */
 	if (!NO_COMPRESS && cti->c_len >= 64) {
 		/* Any Filter */
-		if (LZMA_COMPRESS)
+		if (AUTO_COMPRESS)
+			ret = auto_compress_buf(control, cti, current_thread);
+		else if (LZMA_COMPRESS)
 			ret = lzma_compress_buf(control, cti, current_thread);
 		else if (LZO_COMPRESS)
 			ret = lzo_compress_buf(control, cti, current_thread);
@@ -1657,27 +2132,31 @@ retry:
 		 * data */
 			if (padded_len < *control->enc_keylen)
 				padded_len = *control->enc_keylen;
-			cti->s_buf = realloc(cti->s_buf, padded_len);
-			if (unlikely(!cti->s_buf))
-				fatal("Failed to realloc s_buf in compthread\n");
+			if (unlikely((size_t)padded_len > buffer_size(control, cti->s_buf))) {
+				uchar *buf = get_buffer(control, padded_len);
+
+				if (unlikely(!buf))
+					fatal("Failed to allocate s_buf in compthread\n");
+				memcpy(buf, cti->s_buf, cti->c_len);
+				put_buffer(control, cti->s_buf);
+				cti->s_buf = buf;
+			}
 			gcry_create_nonce(cti->s_buf + cti->c_len, padded_len - cti->c_len);
 		}
 	}
 
 	/* If compression fails for whatever reason multithreaded, then wait
-	 * for the previous thread to finish, serialising the work to decrease
-	 * the memory requirements, increasing the chance of success */
+	 * for the previous blocks to be written, serialising the work to
+	 * decrease the memory requirements, increasing the chance of success */
 	if (unlikely(ret && waited))
 		fatal("Failed to compress in compthread\n");
 
-	if (!waited) {
+	if (unlikely(ret)) {
 		lock_mutex(control, &output_lock);
 		while (output_thread != current_thread)
 			cond_wait(control, &output_cond, &output_lock);
 		unlock_mutex(control, &output_lock);
 		waited = 1;
-	}
-	if (unlikely(ret)) {
 		print_maxverbose("Unable to compress in parallel, waiting for previous thread to complete before trying again\n");
 		if (FILTER_USED && cti->streamno == 1 ) {	// As unlikely as this is, we have to undo filtering here
 			print_maxverbose("Reverting filtering...\n");
@@ -1713,14 +2192,33 @@ retry:
 		goto retry;
 	}
 
-	/* Need to be big enough to fill one CBC_LEN */
-	if (ENCRYPT)
-		write_len = 8;
-	else
-		write_len = ctis->chunk_bytes;
+	/* Queue the block for the writer and go on to the next job */
+	lock_mutex(control, &output_lock);
+	uncompressed--;
+	cti->ready = true;
+	cond_broadcast(control, &output_cond);
+	unlock_mutex(control, &output_lock);
+
+	return NULL;
+}
+
+/* Write a compressed block at the end of the archive and list it in the block
+ * directory of its chunk */
+static bool write_block(rzip_control *control, int current_thread)
+{
+	struct compress_thread *cti = &cthreads[current_thread];
+	struct stream_info *ctis = cti->sinfo;
+	struct block_entry *entry;
+	i64 padded_len = cti->c_len;
+
+	if (ENCRYPT && padded_len < *control->enc_keylen)
+		padded_len = *control->enc_keylen;
 
 	if (!ctis->chunks++) {
-		int j;
+		/* Piped input may still be arriving, wait for the size of the
+		 * chunk and whether it is the last */
+		if (ctis->sized_later)
+			cksem_wait(control, &ctis->sized);
 
 		if (TMP_OUTBUF) {
 			lock_mutex(control, &control->control_lock);
@@ -1730,117 +2228,181 @@ retry:
 
 			if (unlikely(!flush_tmpoutbuf(control))) {
 				print_err("Failed to flush_tmpoutbuf in compthread\n");
-				goto error;
+				return false;
 			}
 		}
 
 		print_maxverbose("Writing initial chunk bytes value %'d at %'"PRId64"\n",
 				 ctis->chunk_bytes, get_seek(control, ctis->fd));
-		/* Write chunk bytes of this block */
-		write_u8(control, ctis->chunk_bytes);
+		/* Write chunk bytes of this block, flagged when matches reach
+		 * into earlier chunks */
+		write_u8(control, ctis->chunk_bytes | (GLOBAL_INDEX ? CHUNK_HISTORY : 0));
 
 		/* Write whether this is the last chunk, followed by the size
 		 * of this chunk */
-		print_maxverbose("Writing EOF flag as %'d\n", control->eof);
-		write_u8(control, control->eof);
+		print_maxverbose("Writing EOF flag as %'d\n", ctis->eof);
+		write_u8(control, ctis->eof);
 		if (!ENCRYPT)
 			write_val(control, ctis->size, ctis->chunk_bytes);
-
-		/* First chunk of this stream, write headers */
 		ctis->initial_pos = get_seek(control, ctis->fd);
 		if (unlikely(ctis->initial_pos == -1))
-			goto error;
-
-		print_maxverbose("Writing initial header at %'"PRId64"\n", ctis->initial_pos);
-		for (j = 0; j < ctis->num_streams; j++) {
-			/* If encrypting, we leave SALT_LEN room to write in salt
-			* later */
-			if (ENCRYPT) {
-				if (unlikely(write_val(control, 0, SALT_LEN)))
-					fatal("Failed to write_buf blank salt in compthread %'d\n", current_thread);
-				ctis->cur_pos += SALT_LEN;
-			}
-			ctis->s[j].last_head = ctis->cur_pos + 1 + (write_len * 2);
-			write_u8(control, CTYPE_NONE);
-			write_val(control, 0, write_len);
-			write_val(control, 0, write_len);
-			write_val(control, 0, write_len);
-			ctis->cur_pos += 1 + (write_len * 3);
-		}
+			return false;
 	}
 
-	print_maxverbose("Compthread %'d seeking to %'"PRId64" to store length %'d\n", current_thread, ctis->s[cti->streamno].last_head, write_len);
-
-	if (unlikely(seekto(control, ctis, ctis->s[cti->streamno].last_head)))
-		fatal("Failed to seekto in compthread %'d\n", current_thread);
-
-	if (unlikely(write_val(control, ctis->cur_pos, write_len)))
-		fatal("Failed to write_val cur_pos in compthread %'d\n", current_thread);
-
-	if (ENCRYPT)
-		rewrite_encrypted(control, ctis, ctis->s[cti->streamno].last_head - 17);
-
-	ctis->s[cti->streamno].last_head = ctis->cur_pos + 1 + (write_len * 2) + (ENCRYPT ? SALT_LEN : 0);
-
-	print_maxverbose("Compthread %'d seeking to %'"PRId64" to write header\n", current_thread, ctis->cur_pos);
-
-	if (unlikely(seekto(control, ctis, ctis->cur_pos)))
-		fatal("Failed to seekto cur_pos in compthread %'d\n", current_thread);
-
-	print_maxverbose("Thread %'d writing %'"PRId64" compressed bytes from stream %'d\n", current_thread, padded_len, cti->streamno);
-
-	if (ENCRYPT) {
-		if (unlikely(write_val(control, 0, SALT_LEN)))
-			fatal("Failed to write_buf header salt in compthread %'d\n", current_thread);
-		ctis->cur_pos += SALT_LEN;
-		ctis->s[cti->streamno].last_headofs = ctis->cur_pos;
+	/* A stream ending on a full buffer leaves an empty last block, which
+	 * is not stored */
+	if (!cti->s_len) {
+		put_buffer(control, cti->s_buf);
+		cti->s_buf = NULL;
+		return true;
 	}
-	/* We store the actual c_len even though we might pad it out */
-	if (unlikely(write_u8(control, cti->c_type) ||
-		write_val(control, cti->c_len, write_len) ||
-		write_val(control, cti->s_len, write_len) ||
-		write_val(control, 0, write_len))) {
-			fatal("Failed write in compthread %'d\n", current_thread);
+
+	if (ctis->dir_blocks == ctis->dir_size) {
+		ctis->dir_size = ctis->dir_size ? ctis->dir_size * 2 : 16;
+		ctis->dir = realloc(ctis->dir, ctis->dir_size * sizeof(struct block_entry));
+		if (unlikely(!ctis->dir))
+			fatal("Failed to realloc block directory in compthread %'d\n", current_thread);
 	}
-	ctis->cur_pos += 1 + (write_len * 3);
+	entry = &ctis->dir[ctis->dir_blocks++];
+	entry->offset = ctis->cur_pos;
+	entry->c_len = cti->c_len;	/* the actual c_len even though we might pad it out */
+	entry->u_len = cti->s_len;
+	entry->c_type = cti->c_type;
+	entry->streamno = cti->streamno;
+
+	print_maxverbose("Thread %'d writing %'"PRId64" compressed bytes from stream %'d at %'"PRId64"\n",
+			 current_thread, padded_len, cti->streamno, ctis->cur_pos);
 
 	if (ENCRYPT) {
 		gcry_create_nonce(cti->salt, SALT_LEN);
 		if (unlikely(write_buf(control, cti->salt, SALT_LEN)))
 			fatal("Failed to write_buf block salt in compthread %'d\n", current_thread);
 		if (unlikely(!lrz_encrypt(control, cti->s_buf, padded_len, cti->salt)))
-			goto error;
+			return false;
 		ctis->cur_pos += SALT_LEN;
 	}
 
-	print_maxverbose("Compthread %'d writing data at %'"PRId64"\n", current_thread, ctis->cur_pos);
-
 	if (unlikely(write_buf(control, cti->s_buf, padded_len)))
 		fatal("Failed to write_buf s_buf in compthread %'d\n", current_thread);
 
 	ctis->cur_pos += padded_len;
-	dealloc(cti->s_buf);
+	put_buffer(control, cti->s_buf);
+	cti->s_buf = NULL;
+	return true;
+}
 
-	lock_mutex(control, &output_lock);
-	if (++output_thread == control->threads)
-		output_thread = 0;
-	cond_broadcast(control, &output_cond);
-	unlock_mutex(control, &output_lock);
+/* Write the block directory after the last block of a chunk, followed by
+ * the trailer of its block count and its offset from the chunk start */
+static bool write_directory(rzip_control *control, struct stream_info *sinfo)
+{
+	i64 dir_ofs = sinfo->cur_pos, len, i;
+	uchar salt[SALT_LEN], *buf, *p;
+
+	len = sinfo->dir_blocks * BLOCK_ENTRY_LEN;
+	if (ENCRYPT && len < *control->enc_keylen)
+		len = *control->enc_keylen;
+	buf = calloc(MAX(len, 1), 1);
+	if (unlikely(!buf))
+		fatal("Failed to calloc block directory in write_directory\n");
+	for (i = 0, p = buf; i < sinfo->dir_blocks; i++, p += BLOCK_ENTRY_LEN) {
+		struct block_entry *entry = &sinfo->dir[i];
+		i64 v;
+
+		p[0] = entry->streamno;
+		p[1] = entry->c_type;
+		v = htole64(entry->c_len);
+		memcpy(p + 2, &v, 8);
+		v = htole64(entry->u_len);
+		memcpy(p + 10, &v, 8);
+	}
+	if (ENCRYPT && sinfo->dir_blocks * BLOCK_ENTRY_LEN < len)
+		gcry_create_nonce(p, len - sinfo->dir_blocks * BLOCK_ENTRY_LEN);
+
+	print_maxverbose("Writing block directory of %'"PRId64" blocks at %'"PRId64"\n", sinfo->dir_blocks, dir_ofs);
+	if (ENCRYPT) {
+		gcry_create_nonce(salt, SALT_LEN);
+		if (unlikely(write_buf(control, salt, SALT_LEN)))
+			goto error;
+		if (unlikely(!lrz_encrypt(control, buf, len, salt)))
+			goto error;
+		sinfo->cur_pos += SALT_LEN;
+	}
+	if (unlikely(len && write_buf(control, buf, len)))
+		goto error;
+	dealloc(buf);
 
+	/* The trailer ending the chunk lets the decoder find the directory
+	 * from the end of the chunk, so nothing is written out of order */
+	if (unlikely(write_val(control, sinfo->dir_blocks, 8) ||
+		     write_val(control, dir_ofs + CHUNK_HEAD_LEN(sinfo->chunk_bytes), 8)))
+		return false;
+	sinfo->cur_pos += len + CHUNK_TRAILER_LEN;
+	dealloc(sinfo->dir);
+	sinfo->dir_blocks = sinfo->dir_size = 0;
+	return true;
 error:
-	cksem_post(control, &cti->cksem);
+	dealloc(buf);
+	return false;
+}
+
+/* Write the compressed blocks in order as they become ready, freeing each
+ * slot for clear_buffer */
+static void *output_writer(void *data)
+{
+	rzip_control *control = data;
+	struct compress_thread *cti;
+
+	while (42) {
+		lock_mutex(control, &output_lock);
+		while (!cthreads[output_thread].ready && !writer_stop)
+			cond_wait(control, &output_cond, &output_lock);
+		cti = &cthreads[output_thread];
+		unlock_mutex(control, &output_lock);
+		if (!cti->ready)
+			break;
+
+		if (cti->streamno < 0) {
+			if (unlikely(!write_directory(control, cti->sinfo)))
+				fatal("Failed to write block directory in output_writer\n");
+		} else if (unlikely(!write_block(control, output_thread)))
+			fatal("Failed to write block %'d in output_writer\n", output_thread);
+		/* Nothing written is sought back to, so piped output goes out
+		 * as soon as each block is written */
+		if (TMP_OUTBUF && unlikely(!flush_tmpoutbuf(control)))
+			fatal("Failed to flush_tmpoutbuf in output_writer\n");
 
+		lock_mutex(control, &output_lock);
+		cti->ready = false;
+		if (++output_thread == out_slots)
+			output_thread = 0;
+		cond_broadcast(control, &output_cond);
+		unlock_mutex(control, &output_lock);
+		cksem_post(control, &cti->cksem);
+	}
 	return NULL;
 }
 
+/* Wait for the next slot in order to be written and take it */
+static int take_slot(rzip_control *control)
+{
+	int slot = input_thread;
+
+	cksem_wait(control, &cthreads[slot].cksem);
+	if (++input_thread == out_slots)
+		input_thread = 0;
+	return slot;
+}
+
 static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int streamno, int newbuf)
 {
-	pthread_t *threads = control->pthreads;
-	stream_thread_struct *s;
-	static int current_thread = 0;
+	int current_thread = take_slot(control);
 
-	/* Make sure this thread doesn't already exist */
-	cksem_wait(control, &cthreads[current_thread].cksem);
+	/* Wait for the ram of a block to compress */
+	lock_mutex(control, &output_lock);
+	while (uncompressed >= control->threads)
+		cond_wait(control, &output_cond, &output_lock);
+	uncompressed++;
+	unlock_mutex(control, &output_lock);
 
 	cthreads[current_thread].sinfo = sinfo;
 	cthreads[current_thread].streamno = streamno;
@@ -1850,49 +2412,60 @@ static void clear_buffer(rzip_control *control, struct stream_info *sinfo, int s
 	print_maxverbose("Starting thread %'d to compress %'"PRId64" bytes from stream %'d\n",
 			 current_thread, cthreads[current_thread].s_len, streamno);
 
-	s = malloc(sizeof(stream_thread_struct));
-	if (unlikely(!s)) {
-		cksem_post(control, &cthreads[current_thread].cksem);
-		fatal("Unable to malloc in clear_buffer");
-	}
-	s->i = current_thread;
-	s->control = control;
-	if (unlikely((!create_pthread(control, &threads[current_thread], NULL, compthread, s)) ||
-	             (!detach_pthread(control, &threads[current_thread]))))
-		fatal("Unable to create compthread in clear_buffer");
+	queue_backend_job(control, &cthreads[current_thread].job, compthread, sinfo, current_thread);
 
 	if (newbuf) {
 		/* The stream buffer has been given to the thread, allocate a
 		 * new one. */
-		sinfo->s[streamno].buf = malloc(sinfo->bufsize);
+		sinfo->s[streamno].buf = get_buffer(control, sinfo->bufsize);
 		if (unlikely(!sinfo->s[streamno].buf))
 			fatal("Unable to malloc buffer of size %'"PRId64" in flush_buffer\n", sinfo->bufsize);
 		sinfo->s[streamno].buflen = 0;
 	}
+}
 
-	if (++current_thread == control->threads)
-		current_thread = 0;
+/* Keep a full stream buffer in order for replay_stream_out, waiting for
+ * earlier chunks to be written while too much is held back */
+static void capture_buffer(rzip_control *control, struct stream_info *sinfo, int streamno)
+{
+	struct stream_block *block = malloc(sizeof(struct stream_block));
+
+	if (unlikely(!block))
+		fatal("Unable to malloc in capture_buffer\n");
+	lock_mutex(control, &captured.lock);
+	while (!sinfo->capture_free && captured.bytes &&
+	       captured.bytes + sinfo->bufsize > captured.limit)
+		cond_wait(control, &captured.cond, &captured.lock);
+	captured.bytes += sinfo->bufsize;
+	unlock_mutex(control, &captured.lock);
+	block->buf = sinfo->s[streamno].buf;
+	block->len = sinfo->s[streamno].buflen;
+	block->streamno = streamno;
+	block->next = NULL;
+	*sinfo->last_block = block;
+	sinfo->last_block = &block->next;
+
+	sinfo->s[streamno].buf = get_buffer(control, sinfo->bufsize);
+	if (unlikely(!sinfo->s[streamno].buf))
+		fatal("Unable to malloc buffer of size %'"PRId64" in capture_buffer\n", sinfo->bufsize);
+	sinfo->s[streamno].buflen = 0;
 }
 
 /* flush out any data in a stream buffer */
 void flush_buffer(rzip_control *control, struct stream_info *sinfo, int streamno)
 {
-	clear_buffer(control, sinfo, streamno, 1);
+	if (sinfo->capture)
+		capture_buffer(control, sinfo, streamno);
+	else
+		clear_buffer(control, sinfo, streamno, 1);
 }
 
 static void *ucompthread(void *data)
 {
-	stream_thread_struct *sts = data;
-	rzip_control *control = sts->control;
-	int waited = 0, ret = 0, current_thread = sts->i;
-	struct uncomp_thread *uci = &sts->sinfo->ucthreads[current_thread];
-
-	dealloc(data);
-
-	if (unlikely(setpriority(PRIO_PROCESS, 0, control->nice_val) == -1)) {
-		print_err("Warning, unable to set thread nice value %'d...Resetting to %'d\n", control->nice_val, control->current_priority);
-		setpriority(PRIO_PROCESS, 0, (control->nice_val=control->current_priority));
-	}
+	struct backend_job *job = data;
+	rzip_control *control = job->control;
+	int waited = 0, ret = 0, current_thread = job->i;
+	struct uncomp_thread *uci = &job->sinfo->ucthreads[current_thread];
 
 retry:
 	if (uci->c_type != CTYPE_NONE) {
@@ -2025,18 +2598,39 @@ static int fill_buffer(rzip_control *control, struct stream_info *sinfo, struct
 	i64 u_len, c_len, last_head, padded_len, header_length, max_len;
 	uchar enc_head[25 + SALT_LEN], blocksalt[SALT_LEN];
 	struct uncomp_thread *ucthreads = sinfo->ucthreads;
-	pthread_t *threads = control->pthreads;
-	stream_thread_struct *sts;
 	uchar c_type, *s_buf;
-	void *thr_return;
 
-	dealloc(s->buf);
+	put_buffer(control, s->buf);
+	s->buf = NULL;
 	if (s->eos)
 		goto out;
 fill_another:
 	if (unlikely(ucthreads[s->uthread_no].busy))
 		fatal("Trying to start a busy thread, this shouldn't happen!\n");
 
+	if (sinfo->dir) {
+		struct block_entry *entry = &sinfo->dir[s->last_head];
+
+		if (unlikely(read_seekto(control, sinfo, entry->offset)))
+			return -1;
+		if (ENCRYPT && unlikely(read_buf(control, sinfo->fd, blocksalt, SALT_LEN)))
+			return -1;
+		c_type = entry->c_type;
+		c_len = entry->c_len;
+		u_len = entry->u_len;
+		/* The last_head of a stream is the index of its next block in
+		 * the directory, 0 when there is none */
+		for (last_head = s->last_head + 1; last_head < sinfo->dir_blocks; last_head++) {
+			if (sinfo->dir[last_head].streamno == streamno)
+				break;
+		}
+		if (last_head == sinfo->dir_blocks)
+			last_head = 0;
+		print_maxverbose("Fill_buffer stream %'d c_len %'"PRId64" u_len %'"PRId64" block %'"PRId64" at %'"PRId64"\n",
+				 streamno, c_len, u_len, s->last_head, entry->offset);
+		goto read_block;
+	}
+
 	if (unlikely(read_seekto(control, sinfo, s->last_head)))
 		return -1;
 
@@ -2093,7 +2687,9 @@ fill_another:
 	 * 	compressed length (c_len)
 	 * 	uncompressed length (u_len)
 	 * 	invalid current stream pointer (last_head < 0)
-	 * 	stream pointer extending beyond chunk (last_head > sinfo->size)
+	 * 	stream pointer extending well beyond chunk (last_head > sinfo->size * 2).
+	 * 	An incompressible chunk takes a little more than its size with
+	 * 	the match and block headers added.
 	 * 	stream pointer less than last stream pointer (i.e. pointing backwards!)
 	 *	Encrypt check requires slightly different test. Doesn't know sinfo->size yet
 	 */
@@ -2102,35 +2698,36 @@ fill_another:
 			fatal("Invalid data compressed len %'"PRId64" uncompressed %'"PRId64" last_head %'"PRId64" chunk size %'"PRId64"\n",
 			     c_len, u_len, last_head, sinfo->size);
 	} else {
-		if (unlikely(c_len < 1 || u_len < 1 || last_head < 0 || last_head > sinfo->size ||
+		if (unlikely(c_len < 1 || u_len < 1 || last_head < 0 || last_head > sinfo->size * 2 ||
 				(last_head && (last_head <= s->last_head))))
 			fatal("Invalid data compressed len %'"PRId64" uncompressed %'"PRId64" last_head %'"PRId64" chunk size %'"PRId64"\n",
 			     c_len, u_len, last_head, sinfo->size);
 	}
 
+	sinfo->total_read += MAX(c_len, *control->enc_keylen);
+read_block:
 	/* if encryption used, control->enc_code will be > 0
 	 * otherwise length = 0 */
 	padded_len = MAX(c_len, *control->enc_keylen);
-	sinfo->total_read += padded_len;
 	fsync(control->fd_out);
 
 	if (unlikely(u_len > control->maxram))
 		print_progress("Warning, attempting to malloc very large buffer for this environment of size %'"PRId64"\n", u_len);
 	max_len = MAX(u_len, *control->enc_keylen);
 	max_len = MAX(max_len, c_len);
-	s_buf = malloc(max_len);
+	s_buf = get_buffer(control, max_len);
 	if (unlikely(!s_buf))
 		fatal("Unable to malloc buffer of size %'"PRId64" in fill_buffer\n", u_len);
 	sinfo->ram_alloced += u_len;
 
 	if (unlikely(read_buf(control, sinfo->fd, s_buf, padded_len))) {
-		dealloc(s_buf);
+		put_buffer(control, s_buf);
 		return -1;
 	}
 
 	// pass decrypt flag
 	if (unlikely(ENCRYPT && !lrz_decrypt(control, s_buf, padded_len, blocksalt, LRZ_DECRYPT))) {
-		dealloc(s_buf);
+		put_buffer(control, s_buf);
 		return -1;
 	}
 
@@ -2146,16 +2743,7 @@ fill_another:
 	print_maxverbose("Starting thread %d to decompress %'"PRId64" bytes from stream %'d\n",
 			 s->uthread_no, padded_len, streamno);
 
-	sts = malloc(sizeof(stream_thread_struct));
-	if (unlikely(!sts))
-		fatal("Unable to malloc in fill_buffer");
-	sts->i = s->uthread_no;
-	sts->control = control;
-	sts->sinfo = sinfo;
-	if (unlikely(!create_pthread(control, &threads[s->uthread_no], NULL, ucompthread, sts))) {
-		dealloc(sts);
-		return -1;
-	}
+	queue_backend_job(control, &ucthreads[s->uthread_no].job, ucompthread, sinfo, s->uthread_no);
 
 	if (++s->uthread_no == s->base_thread + s->total_threads)
 		s->uthread_no = s->base_thread;
@@ -2175,10 +2763,8 @@ out:
 	cond_broadcast(control, &output_cond);
 	unlock_mutex(control, &output_lock);
 
-	/* join_pthread here will make it wait till the data is ready */
-	thr_return = NULL;
-	if (unlikely(!join_pthread(control, threads[s->unext_thread], &thr_return) || !!thr_return))
-		return -1;
+	/* Wait till the data is ready */
+	wait_backend_job(control, &ucthreads[s->unext_thread].job);
 	ucthreads[s->unext_thread].busy = 0;
 
 	print_maxverbose("Taking decompressed data from thread %d\n", s->unext_thread);
@@ -2253,26 +2839,20 @@ i64 read_stream(rzip_control *control, void *ss, int streamno, uchar *p, i64 len
 int close_stream_out(rzip_control *control, void *ss)
 {
 	struct stream_info *sinfo = ss;
-	int i;
+	int i, slot;
 
 	for (i = 0; i < sinfo->num_streams; i++)
 		clear_buffer(control, sinfo, i, 0);
 
-	if (ENCRYPT) {
-		/* Last two compressed blocks do not have an offset written
-		 * to them so we have to go back and encrypt them now, but we
-		 * must wait till the threads return. */
-		int close_thread = output_thread;
-
-		for (i = 0; i < control->threads; i++) {
-			cksem_wait(control, &cthreads[close_thread].cksem);
-			cksem_post(control, &cthreads[close_thread].cksem);
-			if (++close_thread == control->threads)
-				close_thread = 0;
-		}
-		for (i = 0; i < sinfo->num_streams; i++)
-			rewrite_encrypted(control, sinfo, sinfo->s[i].last_headofs);
-	}
+	/* The block directory takes the next slot so the writer stores it
+	 * after the last block of the chunk. Nothing waits for it here. */
+	slot = take_slot(control);
+	cthreads[slot].sinfo = sinfo;
+	cthreads[slot].streamno = -1;
+	lock_mutex(control, &output_lock);
+	cthreads[slot].ready = true;
+	cond_broadcast(control, &output_cond);
+	unlock_mutex(control, &output_lock);
 
 	/* Note that sinfo->s and sinfo are not released here but after compression
 	* has completed as they cannot be freed immediately because their values
@@ -2281,6 +2861,92 @@ int close_stream_out(rzip_control *control, void *ss)
 	return 0;
 }
 
+/* Hold back the buffers of an output stream so its chunk can be searched
+ * while earlier chunks are still being written */
+void capture_stream_out(void *ss)
+{
+	struct stream_info *sinfo = ss;
+
+	sinfo->capture = true;
+	sinfo->capture_free = false;
+	sinfo->blocks = NULL;
+	sinfo->last_block = &sinfo->blocks;
+}
+
+/* The most ram all held back streams may take */
+void limit_captured(i64 limit)
+{
+	captured.limit = limit;
+}
+
+/* The chunk of ss is the next to be written, let it hold back as much as
+ * it needs */
+void release_stream_out(rzip_control *control, void *ss)
+{
+	struct stream_info *sinfo = ss;
+
+	lock_mutex(control, &captured.lock);
+	sinfo->capture_free = true;
+	cond_broadcast(control, &captured.cond);
+	unlock_mutex(control, &captured.lock);
+}
+
+/* Hand the held back buffers to the compression threads in the order they
+ * were flushed, then close the streams as close_stream_out does */
+int replay_stream_out(rzip_control *control, void *ss)
+{
+	struct stream_info *sinfo = ss;
+	struct stream_block *block, *next;
+	uchar *buf[NUM_STREAMS];
+	i64 buflen[NUM_STREAMS];
+	int i;
+
+	/* Set aside the last partly filled buffers */
+	for (i = 0; i < sinfo->num_streams; i++) {
+		buf[i] = sinfo->s[i].buf;
+		buflen[i] = sinfo->s[i].buflen;
+	}
+	for (block = sinfo->blocks; block; block = next) {
+		next = block->next;
+		sinfo->s[block->streamno].buf = block->buf;
+		sinfo->s[block->streamno].buflen = block->len;
+		clear_buffer(control, sinfo, block->streamno, 0);
+		dealloc(block);
+		lock_mutex(control, &captured.lock);
+		captured.bytes -= sinfo->bufsize;
+		cond_broadcast(control, &captured.cond);
+		unlock_mutex(control, &captured.lock);
+	}
+	for (i = 0; i < sinfo->num_streams; i++) {
+		sinfo->s[i].buf = buf[i];
+		sinfo->s[i].buflen = buflen[i];
+	}
+	sinfo->blocks = NULL;
+	sinfo->capture = false;
+	return close_stream_out(control, ss);
+}
+
+/* The chunk of an output stream is still being read. Its first block is
+ * held back until set_stream_size is called. */
+void defer_stream_size(rzip_control *control, void *ss)
+{
+	struct stream_info *sinfo = ss;
+
+	sinfo->sized_later = true;
+	cksem_init(control, &sinfo->sized);
+}
+
+/* Set the final size of the chunk, control->eof must already be set */
+void set_stream_size(rzip_control *control, void *ss, i64 size)
+{
+	struct stream_info *sinfo = ss;
+
+	sinfo->size = MAX(size, control->page_size);
+	sinfo->eof = control->eof;
+	if (sinfo->sized_later)
+		cksem_post(control, &sinfo->sized);
+}
+
 /* Add to an runzip list to safely deallocate memory after all threads have
  * returned. */
 static void add_to_rulist(rzip_control *control, struct stream_info *sinfo)
@@ -2290,8 +2956,7 @@ static void add_to_rulist(rzip_control *control, struct stream_info *sinfo)
 	if (unlikely(!node))
 		fatal("Failed to calloc struct node in add_rulist\n");
 	node->sinfo = sinfo;
-	node->pthreads = control->pthreads;
-	node->prev = control->rulist;
+	node->prev = control->ruhead;
 	control->ruhead = node;
 }
 
@@ -2301,14 +2966,31 @@ int close_stream_in(rzip_control *control, void *ss)
 	struct stream_info *sinfo = ss;
 	int i;
 
+	/* A stream that ended on a full buffer is followed by an empty block,
+	 * written last in the chunk before 0.15. It is only read when
+	 * decompressing ahead, so count it here or the next chunk is looked
+	 * for inside it. */
+	for (i = 0; i < sinfo->num_streams && !sinfo->dir; i++) {
+		if (sinfo->s[i].eos || !sinfo->s[i].last_head)
+			continue;
+		print_maxverbose("Skipping empty block of stream %'d\n", i);
+		if (ENCRYPT)
+			sinfo->total_read += SALT_LEN + 25 + SALT_LEN + *control->enc_keylen;
+		else
+			sinfo->total_read += 1 + (sinfo->chunk_bytes * 3);
+	}
+
 	print_maxverbose("Closing stream at %'"PRId64", want to seek to %'"PRId64"\n",
 			 get_readseek(control, control->fd_in),
 			 sinfo->initial_pos + sinfo->total_read);
 	if (unlikely(read_seekto(control, sinfo, sinfo->total_read)))
 		return -1;
 
-	for (i = 0; i < sinfo->num_streams; i++)
-		dealloc(sinfo->s[i].buf);
+	for (i = 0; i < sinfo->num_streams; i++) {
+		put_buffer(control, sinfo->s[i].buf);
+		sinfo->s[i].buf = NULL;
+	}
+	dealloc(sinfo->dir);
 
 	output_thread = 0;
 	/* We cannot safely release the sinfo and pthread data here till all
@@ -2337,7 +3019,8 @@ static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
 	buftest_size = in_len;
 	d_len = in_len+1;
 
-	c_buf = malloc(d_len);
+	/* Big enough for the largest test, so it is never grown */
+	c_buf = get_buffer(control, s_len + 1);
 	if (unlikely(!c_buf))
 		fatal("Unable to allocate c_buf in lz4_compresses\n");
 
@@ -2363,9 +3046,6 @@ static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
 				buftest_size <<= 1;
 			in_len = MIN(test_len, buftest_size);
 			d_len = in_len+1;		// Make sure dlen is increased as buffer test does
-			c_buf = realloc(c_buf, d_len);
-			if (unlikely(!c_buf))
-				fatal("Unable to reallocate c_buf in lz4_compresses\n");
 		}
 	}
 	/* if pct >0 and <1 round up so return value won't show failed */
@@ -2374,7 +3054,7 @@ static int lz4_compresses(rzip_control *control, uchar *s_buf, i64 s_len)
 			(return_value > 0 ? "OK" : "FAILED"), s_len,
 			pct, buftest_size, workcounter);
 
-	dealloc(c_buf);
+	put_buffer(control, c_buf);
 
 	return return_value;
 }
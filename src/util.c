@@ -278,9 +278,13 @@ bool read_config(rzip_control *control)
 			}
 		}
 		else if (isparameter(parameter, "rziplevel")) {
+			if (isparameter(parametervalue, "auto")) {
+				control->rzip_auto = true;
+				continue;
+			}
 			control->rzip_compression_level = atoi(parametervalue);
-			if ( control->rzip_compression_level < 1 || control->rzip_compression_level > 9 ) {
-				print_err("CONF.FILE error. RZIP Compression Level must between 1 and 9. Resetting to 7\n");
+			if ( control->rzip_compression_level < 1 || control->rzip_compression_level > 10 ) {
+				print_err("CONF.FILE error. RZIP Compression Level must between 1 and 10. Resetting to 7\n");
 				control->rzip_compression_level = 7;
 				continue;
 			}
@@ -0,0 +1,110 @@
+#!/bin/sh
+# lrzip-next rzip search benchmark
+# if running as root, uncomment drop_caches line
+usage() {
+	echo "LRZIP-NEXT RZIP Search Benchmark\n\
+usage: $0 -f filename [ -l LEVELS ] [ -r RUNS ] [ -o TESTFILE ] [ -x EXTRA OPTIONS ] [ -p PROGRAM ] [ -c PROGRAM ][ -h | -? ]\n\n\
+Measures the rzip pre-processing search alone, in positions per second, using\n\
+the search times lrzip-next reports at maximum verbosity. No backend compression\n\
+is done.\n\
+LEVELS are rzip levels, one or more of [1, 2, 3, 4, 5, 6, 7, 8, 9] in any order.\n\
+- for multiple LEVELS, be sure to quote, i,e, \"7 8 9\"\n\
+- if no LEVELS are selected, then levels 7, 8 and 9 will be used.\n\
+RUNS is how many times each level is run. The average is reported. Default 3.\n\
+if TESTFILE is not speciied, default is searchbench.csv\n\
+- Output file will be a comma-delimited (CSV) file.\n\
+Extra Options will be passed to lrzip-next, e.g. \"-U\" or \"--rzip-threads=4\", etc. Be sure to quote.\n\
+- Use a large file, or -U, to test large chunks.\n\
+Program defaults to lrzip-next. Use -p to test another binary, and -c to\n\
+compare it with a second one, e.g. a build without a change being tested."
+	exit 1
+}
+
+die() {
+	echo "Error: $1...Aborting"
+	exit 1
+}
+
+# Run PROGRAM once at rzip level LEVEL and print the positions searched and
+# the seconds it took, summed over all chunks
+search_run() {
+	LC_NUMERIC=C $1 -vvf -n -R$2 -o $OUTPUTDIR/$OUTPUT $EXTRAOPTS $INPUT 2>&1 | \
+		awk '/^Searched/ { gsub(",", "", $2); gsub("s", "", $5); p += $2; t += $5 } END { print p, t }'
+}
+
+while getopts "f:l:r:o:x:p:c:h?" Options
+do
+	case ${Options} in
+		f)	INPUT=${OPTARG} ;;
+		l)	LEVELS="${OPTARG}" ;;
+		r)	RUNS=${OPTARG} ;;
+		o)	TESTFILE="${OPTARG}" ;;
+		x)	EXTRAOPTS="${OPTARG}" ;;
+		p)	PROGRAM=${OPTARG} ;;
+		c)	COMPARE=${OPTARG} ;;
+		h|?|*)	usage ;;
+	esac
+done
+
+[ $# -eq "0" ] && usage
+[ -z "$INPUT" ] && die "No Input File to test"
+[ -z "$LEVELS" ] && LEVELS="7 8 9"
+[ -z "$RUNS" ] && RUNS=3
+[ -z "$TESTFILE" ] && TESTFILE="searchbench.csv"
+[ -z "$PROGRAM" ] && PROGRAM="lrzip-next"
+
+[ ! $(which $PROGRAM) ] && die "$PROGRAM not found"
+[ ! -z "$COMPARE" ] && [ ! $(which $COMPARE) ] && die "$COMPARE not found"
+
+export LRZIP=NOCONFIG
+
+# Customize as needed
+OUTPUTDIR=$PWD
+BASENAME=$(basename $INPUT)
+OUTPUT=$BASENAME.searchbench.lrz
+UID=$(id -u)
+STAT=$(which stat)
+[ $? -ne 0 ] && die "stat program not found"
+INPUTSIZE=$( $STAT --print "%s" $INPUT )
+[ $? -ne 0 ] && die "Input file $INPUT not found"
+[ $UID -eq 0 ] && echo "Running as root user."
+
+echo -n "RZIP search benchmark for file $INPUT, $INPUTSIZE with level(s) $LEVELS, $RUNS run(s) each"
+[ ! -z "$EXTRAOPTS" ] && echo -n " using user-selected options $EXTRAOPTS"
+echo
+
+# Write headers
+
+echo "Program, Level, Input File, Input Size, Positions, Search Time, Positions/s" >$TESTFILE
+
+for LEVEL in $LEVELS
+do
+	for PROG in $PROGRAM $COMPARE
+	do
+		RESULTS=""
+		RUN=0
+		while [ $RUN -lt $RUNS ]
+		do
+			sync
+			# root user?
+			if [ $UID -eq 0 ]; then
+				echo 3 >/proc/sys/vm/drop_caches
+			fi
+			RESULT=$(search_run $PROG $LEVEL)
+			[ $? -ne 0 ] && die "An error occured during compression!"
+			RESULTS="$RESULTS $RESULT"
+			RUN=$((RUN + 1))
+		done
+		rm -f $OUTPUTDIR/$OUTPUT
+		set -- $(echo $RESULTS | awk '{ for (i = 1; i < NF; i += 2) { p += $i; t += $(i + 1) } } \
+			END { if (t > 0) printf "%d %.3f %d", p / (NF / 2), t / (NF / 2), p / t }')
+		[ $# -ne 3 ] && die "$PROG did not report search times. Is it a recent lrzip-next?"
+		POSITIONS=$1
+		SEARCHTIME=$2
+		RATE=$3
+		echo "$PROG, level $LEVEL: $POSITIONS positions in ${SEARCHTIME}s, $RATE positions/s"
+		echo "$PROG, $LEVEL, $INPUT, $INPUTSIZE, $POSITIONS, $SEARCHTIME, $RATE" >> $TESTFILE
+	done
+done
+echo "Results stored in: $TESTFILE"
+exit 0